@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
+#include "forward.h"
+#include "hist.h"
+#include "log.h"
+#include "loop.h"
+#include "report.h"
+#include "threads.h"
+#include "util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Drives synthetic reports through one forwarding interface whose hidraw and
+ * hidg endpoints are socketpairs. The benchmark plays both the device, writing
+ * input reports stamped with their send time, and the host, reading them back
+ * out of the gadget side. */
+struct Bench {
+	struct Interface iface;
+	struct ReportTable reports;
+	struct Loop loop;
+	struct LoopSource shutdown;
+	pthread_t thread;
+	bool stop;
+	int device;
+	int host;
+};
+
+struct BenchResult {
+	uint64_t received;
+	uint64_t lost;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	struct Hist latency;
+};
+
+static void* bench_thread(void* arg) {
+	struct Bench* bench = arg;
+
+	loop_run(&bench->loop, &bench->stop);
+	return NULL;
+}
+
+static uint64_t thread_cpu_ns(pthread_t thread) {
+	struct timespec ts;
+	clockid_t clock;
+
+	if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &ts) < 0) {
+		return 0;
+	}
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool bench_init(struct Bench* bench) {
+	struct timeval timeout = {.tv_sec = 1};
+	int device[2];
+	int host[2];
+
+	memset(bench, 0, sizeof(*bench));
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, device) < 0) {
+		log_errno(ERROR, "Failed to create device socketpair");
+		return false;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, host) < 0) {
+		log_errno(ERROR, "Failed to create host socketpair");
+		close(device[0]);
+		close(device[1]);
+		return false;
+	}
+	bench->device = device[0];
+	bench->host = host[0];
+	/* A report the engine coalesced away must not hang the benchmark */
+	setsockopt(bench->host, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (!set_nonblock(device[1]) || !set_nonblock(host[1])) {
+		goto close_fds;
+	}
+	if (!forward_init(&bench->iface, 0, device[1], host[1], &bench->reports)) {
+		goto close_fds;
+	}
+	bench->iface.hidraw.ops = &socket_ops;
+	bench->iface.hidg.ops = &socket_ops;
+
+	if (!loop_init(&bench->loop)) {
+		goto close_iface;
+	}
+	bench->shutdown.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bench->shutdown.fd < 0) {
+		log_errno(ERROR, "Failed to create shutdown eventfd");
+		goto free_loop;
+	}
+	bench->shutdown.events = EPOLLIN;
+	bench->shutdown.handler = loop_stop_handler;
+	if (!loop_add(&bench->loop, &bench->shutdown)) {
+		goto close_shutdown;
+	}
+	if (!forward_attach(&bench->iface, &bench->loop, NULL)) {
+		goto close_shutdown;
+	}
+	if (!thread_spawn(&bench->thread, bench_thread, bench)) {
+		goto close_shutdown;
+	}
+	return true;
+
+close_shutdown:
+	close(bench->shutdown.fd);
+free_loop:
+	loop_free(&bench->loop);
+close_iface:
+	forward_close(&bench->iface);
+	close(bench->device);
+	close(bench->host);
+	return false;
+close_fds:
+	close(device[0]);
+	close(device[1]);
+	close(host[0]);
+	close(host[1]);
+	return false;
+}
+
+static void bench_free(struct Bench* bench) {
+	uint64_t one = 1;
+
+	bench->stop = true;
+	if (write(bench->shutdown.fd, &one, sizeof(one)) < 0) {
+		log_errno(ERROR, "Failed to signal shutdown");
+	}
+	pthread_join(bench->thread, NULL);
+	forward_log_stats(&bench->iface);
+	close(bench->shutdown.fd);
+	loop_free(&bench->loop);
+	forward_close(&bench->iface);
+	close(bench->device);
+	close(bench->host);
+}
+
+/* Keeps up to window reports in flight until count have been sent */
+static bool bench_run(struct Bench* bench, struct BenchResult* result, uint64_t count, uint64_t window, size_t size) {
+	uint8_t report[REPORT_SIZE_MAX] = {0};
+	uint64_t sent = 0;
+	uint64_t started;
+	uint64_t cpu;
+	uint64_t stamp;
+	ssize_t ret;
+
+	memset(result, 0, sizeof(*result));
+	started = now_ns();
+	cpu = thread_cpu_ns(bench->thread);
+	while (result->received + result->lost < count) {
+		while (sent < count && sent - result->received - result->lost < window) {
+			stamp = now_ns();
+			memcpy(&report[1], &stamp, sizeof(stamp));
+			if (write(bench->device, report, size) != (ssize_t) size) {
+				log_errno(ERROR, "Failed to send report");
+				return false;
+			}
+			++sent;
+		}
+		ret = read(bench->host, report, sizeof(report));
+		if (ret < 0 && errno == EAGAIN) {
+			result->lost = sent - result->received;
+			continue;
+		}
+		if (ret != (ssize_t) size) {
+			log_errno(ERROR, "Failed to receive report");
+			return false;
+		}
+		memcpy(&stamp, &report[1], sizeof(stamp));
+		hist_record(&result->latency, now_ns() - stamp);
+		++result->received;
+	}
+	result->wall_ns = now_ns() - started;
+	result->cpu_ns = thread_cpu_ns(bench->thread) - cpu;
+	return true;
+}
+
+static void bench_log(const char* name, const struct BenchResult* result) {
+	log_fmt(INFO, "%s: %" PRIu64 " reports in %.3f s, %.0f reports/s, %.0f ns CPU per report",
+	        name, result->received, result->wall_ns / 1e9,
+	        result->received * 1e9 / result->wall_ns,
+	        result->received ? (double) result->cpu_ns / result->received : 0.0);
+	if (result->lost) {
+		log_fmt(INFO, ", %" PRIu64 " lost", result->lost);
+	}
+	log_fmt(INFO, "\n");
+	hist_log(&result->latency, "latency");
+}
+
+static void usage(const char* argv0) {
+	log_fmt(ERROR, "Usage: %s [OPTION]...\n", argv0);
+	log_fmt(ERROR, "  -n, --count COUNT   Reports sent in the throughput run (default 1000000)\n");
+	log_fmt(ERROR, "  -s, --size SIZE     Report size in bytes (default 64)\n");
+	log_fmt(ERROR, "  -w, --window COUNT  Reports in flight in the throughput run (default 32)\n");
+}
+
+int main(int argc, char* argv[]) {
+	static const struct option long_options[] = {
+		{"count", required_argument, NULL, 'n'},
+		{"size", required_argument, NULL, 's'},
+		{"window", required_argument, NULL, 'w'},
+		{NULL, 0, NULL, 0},
+	};
+	static struct Bench bench;
+	static struct BenchResult result;
+	uint64_t count = 1000000;
+	uint64_t window = 32;
+	size_t size = 64;
+	int ok = 1;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "n:s:w:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!count || !window || size <= sizeof(uint64_t) || size > REPORT_SIZE_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	set_log_level(INFO);
+	if (!bench_init(&bench)) {
+		return 1;
+	}
+	/* One report in flight measures the latency of an idle engine, the
+	 * window measures how fast it goes when kept busy */
+	if (!bench_run(&bench, &result, count / 10 ? count / 10 : 1, 1, size)) {
+		goto shutdown;
+	}
+	bench_log("ping-pong", &result);
+	if (!bench_run(&bench, &result, count, window, size)) {
+		goto shutdown;
+	}
+	bench_log("throughput", &result);
+	ok = 0;
+
+shutdown:
+	bench_free(&bench);
+	return ok;
+}
@@ -0,0 +1,493 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "hidg.h"
+#include "hist.h"
+#include "log.h"
+#include "report.h"
+#include "threads.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* End-to-end benchmark of the whole passthrough. A virtual source device is
+ * created through uhid and handed to usbhid-gadget-passthru, which is bound to
+ * a loopback UDC such as dummy_hcd's. The gadget then enumerates on the same
+ * machine and shows up as a second hidraw device, so every report injected
+ * into uhid can be timed until it comes back out of the gadget. */
+
+#define E2E_VENDOR 0x1209
+#define E2E_PRODUCT 0x0001
+#define E2E_NAME "usbhid-gadget-passthru e2e source"
+#define E2E_TIMEOUT_MS 10000
+
+/* Vendor defined, one 16 byte input report and one 16 byte output report */
+static const uint8_t default_descriptor[] = {
+	0x06, 0x00, 0xFF, /* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01, /* Usage (0x01) */
+	0xA1, 0x01, /* Collection (Application) */
+	0x15, 0x00, /*   Logical Minimum (0) */
+	0x26, 0xFF, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08, /*   Report Size (8) */
+	0x95, 0x10, /*   Report Count (16) */
+	0x09, 0x02, /*   Usage (0x02) */
+	0x81, 0x02, /*   Input (Data,Var,Abs) */
+	0x09, 0x03, /*   Usage (0x03) */
+	0x91, 0x02, /*   Output (Data,Var,Abs) */
+	0xC0, /* End Collection */
+};
+
+struct Injection {
+	uint64_t stamp;
+	uint64_t sequence;
+};
+
+struct E2e {
+	int uhid;
+	int gadget;
+	pid_t passthru;
+
+	struct ReportTable reports;
+	uint8_t id;
+	size_t size;
+
+	uint64_t count;
+	uint64_t rate;
+	uint64_t sent;
+	bool done;
+	/* Set by the receiver to have the injector give up early */
+	bool stop;
+
+	uint64_t received;
+	uint64_t last_sequence;
+	uint64_t reordered;
+	struct Hist latency;
+};
+
+static bool uhid_write(int fd, const struct uhid_event* ev) {
+	if (write(fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		log_errno(ERROR, "Failed to write uhid event");
+		return false;
+	}
+	return true;
+}
+
+/* Answers what the kernel asks of the virtual device. There are no feature
+ * reports to speak of, so reads fail and writes are accepted. */
+static bool uhid_service(int fd) {
+	struct uhid_event ev;
+	struct uhid_event reply;
+
+	while (read(fd, &ev, sizeof(ev)) > 0) {
+		memset(&reply, 0, sizeof(reply));
+		switch (ev.type) {
+		case UHID_GET_REPORT:
+			reply.type = UHID_GET_REPORT_REPLY;
+			reply.u.get_report_reply.id = ev.u.get_report.id;
+			reply.u.get_report_reply.err = EIO;
+			break;
+		case UHID_SET_REPORT:
+			reply.type = UHID_SET_REPORT_REPLY;
+			reply.u.set_report_reply.id = ev.u.set_report.id;
+			break;
+		default:
+			continue;
+		}
+		if (!uhid_write(fd, &reply)) {
+			return false;
+		}
+	}
+	if (errno != EAGAIN) {
+		log_errno(ERROR, "Failed to read uhid event");
+		return false;
+	}
+	return true;
+}
+
+static bool uhid_create(struct E2e* e2e, const uint8_t* descriptor, size_t size) {
+	struct uhid_event ev = {.type = UHID_CREATE2};
+
+	e2e->uhid = open("/dev/uhid", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (e2e->uhid < 0) {
+		log_errno(ERROR, "Failed to open /dev/uhid");
+		return false;
+	}
+	snprintf((char*) ev.u.create2.name, sizeof(ev.u.create2.name), "%s", E2E_NAME);
+	memcpy(ev.u.create2.rd_data, descriptor, size);
+	ev.u.create2.rd_size = size;
+	/* Not USB, so it cannot be mistaken for the gadget coming back */
+	ev.u.create2.bus = BUS_VIRTUAL;
+	ev.u.create2.vendor = E2E_VENDOR;
+	ev.u.create2.product = E2E_PRODUCT;
+	if (!uhid_write(e2e->uhid, &ev)) {
+		close(e2e->uhid);
+		return false;
+	}
+	return true;
+}
+
+static void uhid_destroy(struct E2e* e2e) {
+	struct uhid_event ev = {.type = UHID_DESTROY};
+
+	uhid_write(e2e->uhid, &ev);
+	close(e2e->uhid);
+}
+
+/* Waits for a hidraw node of a HID device with the benchmark's IDs on bus */
+static bool find_hidraw_node(unsigned bus, char* node, size_t node_size) {
+	uint64_t deadline = now_ns() + E2E_TIMEOUT_MS * 1000000ULL;
+	char path[PATH_MAX];
+	char line[64];
+	struct dirent* dent;
+	unsigned found_bus;
+	unsigned vid;
+	unsigned pid;
+	bool found;
+	DIR* dir;
+	FILE* file;
+
+	while (now_ns() < deadline) {
+		dir = opendir("/sys/class/hidraw");
+		while (dir && (dent = readdir(dir))) {
+			if (dent->d_name[0] == '.') {
+				continue;
+			}
+			snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", dent->d_name);
+			file = fopen(path, "r");
+			if (!file) {
+				continue;
+			}
+			found = false;
+			while (!found && fgets(line, sizeof(line), file)) {
+				found = sscanf(line, "HID_ID=%x:%x:%x", &found_bus, &vid, &pid) == 3 &&
+				        found_bus == bus && vid == E2E_VENDOR && pid == E2E_PRODUCT;
+			}
+			fclose(file);
+			if (found) {
+				snprintf(node, node_size, "%s", dent->d_name);
+				closedir(dir);
+				return true;
+			}
+		}
+		if (dir) {
+			closedir(dir);
+		}
+		usleep(10000);
+	}
+	log_fmt(ERROR, "Timed out waiting for hidraw device on bus %04x\n", bus);
+	return false;
+}
+
+static bool spawn_passthru(struct E2e* e2e, const char* binary, const char* udc, const char* hidraw, char** extra, int nextra) {
+	char* argv[32];
+	int argc = 0;
+	int i;
+
+	if (nextra > (int) (sizeof(argv) / sizeof(*argv)) - 8) {
+		log_fmt(ERROR, "Too many passthru arguments\n");
+		return false;
+	}
+	argv[argc++] = (char*) binary;
+	argv[argc++] = "--name";
+	argv[argc++] = "e2e";
+	argv[argc++] = "--udc";
+	argv[argc++] = (char*) udc;
+	for (i = 0; i < nextra; ++i) {
+		argv[argc++] = extra[i];
+	}
+	argv[argc++] = (char*) hidraw;
+	argv[argc] = NULL;
+
+	e2e->passthru = fork();
+	if (e2e->passthru < 0) {
+		log_errno(ERROR, "Failed to fork");
+		return false;
+	}
+	if (e2e->passthru == 0) {
+		execv(binary, argv);
+		log_errno(ERROR, "Failed to run passthru");
+		_exit(127);
+	}
+	return true;
+}
+
+static bool stop_passthru(struct E2e* e2e) {
+	int status;
+
+	kill(e2e->passthru, SIGINT);
+	if (waitpid(e2e->passthru, &status, 0) < 0) {
+		log_errno(ERROR, "Failed to wait for passthru");
+		return false;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		log_fmt(ERROR, "Passthru exited abnormally (status %d)\n", status);
+		return false;
+	}
+	return true;
+}
+
+static bool inject(struct E2e* e2e) {
+	struct uhid_event ev = {.type = UHID_INPUT2};
+	struct Injection injection = {
+		.stamp = now_ns(),
+		.sequence = e2e->sent,
+	};
+	size_t loc = e2e->reports.numbered;
+
+	ev.u.input2.size = e2e->size;
+	ev.u.input2.data[0] = e2e->id;
+	memcpy(&ev.u.input2.data[loc], &injection, sizeof(injection));
+	if (!uhid_write(e2e->uhid, &ev)) {
+		return false;
+	}
+	++e2e->sent;
+	return true;
+}
+
+/* Returns 1 when a report came back, 0 on timeout and -1 on error */
+static int receive(struct E2e* e2e, int timeout) {
+	struct pollfd pfd = {.fd = e2e->gadget, .events = POLLIN};
+	uint8_t report[REPORT_SIZE_MAX];
+	struct Injection injection;
+	ssize_t size;
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret <= 0) {
+		if (ret < 0 && errno != EINTR) {
+			log_errno(ERROR, "Failed to poll gadget");
+			return -1;
+		}
+		return 0;
+	}
+	size = read(e2e->gadget, report, sizeof(report));
+	if (size < (ssize_t) (e2e->reports.numbered + sizeof(injection))) {
+		log_errno(ERROR, "Failed to read gadget report");
+		return -1;
+	}
+	memcpy(&injection, &report[e2e->reports.numbered], sizeof(injection));
+	hist_record(&e2e->latency, now_ns() - injection.stamp);
+	if (e2e->received && injection.sequence <= e2e->last_sequence) {
+		++e2e->reordered;
+	}
+	e2e->last_sequence = injection.sequence;
+	++e2e->received;
+	return 1;
+}
+
+/* Injects at a fixed rate on its own thread while the main thread receives */
+static void* inject_thread(void* arg) {
+	struct E2e* e2e = arg;
+	uint64_t period = 1000000000ULL / e2e->rate;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (e2e->sent < e2e->count && !__atomic_load_n(&e2e->stop, __ATOMIC_ACQUIRE)) {
+		if (!uhid_service(e2e->uhid) || !inject(e2e)) {
+			break;
+		}
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			++next.tv_sec;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	__atomic_store_n(&e2e->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static bool run(struct E2e* e2e) {
+	pthread_t thread;
+	int ret;
+
+	if (!e2e->rate) {
+		/* One report in flight at a time */
+		while (e2e->sent < e2e->count) {
+			if (!uhid_service(e2e->uhid) || !inject(e2e)) {
+				return false;
+			}
+			ret = receive(e2e, 1000);
+			if (ret < 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (!thread_spawn(&thread, inject_thread, e2e)) {
+		return false;
+	}
+	while (true) {
+		ret = receive(e2e, 1000);
+		if (ret < 0) {
+			__atomic_store_n(&e2e->stop, true, __ATOMIC_RELEASE);
+			break;
+		}
+		if (ret == 0 && __atomic_load_n(&e2e->done, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	pthread_join(thread, NULL);
+	return ret == 0;
+}
+
+static bool load_descriptor(const char* path, uint8_t* descriptor, size_t* size) {
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open report descriptor");
+		return false;
+	}
+	ret = read(fd, descriptor, *size);
+	close(fd);
+	if (ret <= 0) {
+		log_errno(ERROR, "Failed to read report descriptor");
+		return false;
+	}
+	*size = ret;
+	return true;
+}
+
+static void usage(const char* argv0) {
+	log_fmt(ERROR, "Usage: %s [OPTION]... [-- PASSTHRU OPTION...]\n", argv0);
+	log_fmt(ERROR, "  -b, --binary PATH       Passthru to run (default ./usbhid-gadget-passthru)\n");
+	log_fmt(ERROR, "  -d, --descriptor FILE   Binary report descriptor of the source device, e.g.\n");
+	log_fmt(ERROR, "                          copied from a real device's report_descriptor\n");
+	log_fmt(ERROR, "  -n, --count COUNT       Reports to inject (default 10000)\n");
+	log_fmt(ERROR, "  -r, --rate RATE         Reports per second, or 0 to wait for each report\n");
+	log_fmt(ERROR, "                          before sending the next one (default 1000)\n");
+	log_fmt(ERROR, "  -u, --udc UDC           Loopback UDC to bind the gadget to (default\n");
+	log_fmt(ERROR, "                          dummy_udc.0, from the dummy_hcd module)\n");
+}
+
+int main(int argc, char* argv[]) {
+	static const struct option long_options[] = {
+		{"binary", required_argument, NULL, 'b'},
+		{"count", required_argument, NULL, 'n'},
+		{"descriptor", required_argument, NULL, 'd'},
+		{"rate", required_argument, NULL, 'r'},
+		{"udc", required_argument, NULL, 'u'},
+		{NULL, 0, NULL, 0},
+	};
+	static struct E2e e2e;
+	uint8_t descriptor[UHID_DATA_MAX];
+	size_t descriptor_size = sizeof(default_descriptor);
+	const char* binary = "./usbhid-gadget-passthru";
+	const char* udc = "dummy_udc.0";
+	char source[64];
+	char gadget[64];
+	char path[PATH_MAX];
+	uint64_t started;
+	uint64_t elapsed;
+	int ok = 1;
+	int c;
+
+	memcpy(descriptor, default_descriptor, sizeof(default_descriptor));
+	e2e.count = 10000;
+	e2e.rate = 1000;
+	while ((c = getopt_long(argc, argv, "b:d:n:r:u:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			binary = optarg;
+			break;
+		case 'd':
+			descriptor_size = sizeof(descriptor);
+			if (!load_descriptor(optarg, descriptor, &descriptor_size)) {
+				return 1;
+			}
+			break;
+		case 'n':
+			e2e.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			e2e.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'u':
+			udc = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	set_log_level(INFO);
+
+	/* Reports are stamped in the first input report the descriptor defines */
+	if (!report_parse(&e2e.reports, descriptor, descriptor_size) || !e2e.reports.count) {
+		log_fmt(ERROR, "Failed to parse report descriptor\n");
+		return 1;
+	}
+	for (c = 0; c < e2e.reports.count && !e2e.size; ++c) {
+		e2e.id = e2e.reports.reports[c].id;
+		e2e.size = report_size(&e2e.reports, REPORT_INPUT, e2e.id);
+	}
+	if (e2e.size < e2e.reports.numbered + sizeof(struct Injection)) {
+		log_fmt(ERROR, "Need an input report of at least %zu bytes\n", e2e.reports.numbered + sizeof(struct Injection));
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "/sys/class/udc/%s", udc);
+	if (access(path, F_OK) < 0) {
+		log_errno(ERROR, "UDC not found, is dummy_hcd loaded?");
+		return 1;
+	}
+
+	if (!uhid_create(&e2e, descriptor, descriptor_size)) {
+		return 1;
+	}
+	if (!find_hidraw_node(BUS_VIRTUAL, source, sizeof(source))) {
+		goto destroy;
+	}
+	log_fmt(INFO, "Source device is %s\n", source);
+
+	started = now_ns();
+	if (!spawn_passthru(&e2e, binary, udc, source, &argv[optind], argc - optind)) {
+		goto destroy;
+	}
+	if (!find_hidraw_node(BUS_USB, gadget, sizeof(gadget))) {
+		goto stop;
+	}
+	log_fmt(INFO, "Gadget enumerated as %s in %.1f ms\n", gadget, (now_ns() - started) / 1e6);
+
+	snprintf(path, sizeof(path), "/dev/%s", gadget);
+	e2e.gadget = open(path, O_RDWR | O_CLOEXEC);
+	if (e2e.gadget < 0) {
+		log_errno(ERROR, "Failed to open gadget hidraw");
+		goto stop;
+	}
+
+	started = now_ns();
+	if (run(&e2e)) {
+		ok = 0;
+	}
+	elapsed = now_ns() - started;
+	close(e2e.gadget);
+
+	log_fmt(INFO, "%" PRIu64 " of %" PRIu64 " reports received in %.3f s, %.0f reports/s, "
+	        "%" PRIu64 " out of order\n",
+	        e2e.received, e2e.sent, elapsed / 1e9, e2e.received * 1e9 / elapsed, e2e.reordered);
+	hist_log(&e2e.latency, "latency");
+
+stop:
+	if (!stop_passthru(&e2e)) {
+		ok = 1;
+	}
+destroy:
+	uhid_destroy(&e2e);
+	return ok;
+}
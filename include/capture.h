@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+#include "profile.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "HIDCAPT"
+#define CAPTURE_VERSION 1
+/* Sparse until written, and trimmed to what was used on close */
+#define CAPTURE_SIZE_DEFAULT (256UL << 20)
+
+struct Interface;
+
+enum CaptureType {
+	CAPTURE_END,
+	CAPTURE_INPUT,
+	CAPTURE_OUTPUT,
+	/* Feature transactions, the host's SET_REPORT followed by the answer */
+	CAPTURE_SET_FEATURE,
+	CAPTURE_GET_FEATURE,
+};
+
+/* The profile is stored as this build lays it out, so captures are only
+ * guaranteed to replay with the version that wrote them */
+struct CaptureHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	/* Bytes of records that follow, set when the capture is closed */
+	uint64_t used;
+	uint64_t dropped;
+	struct DeviceProfile profile;
+};
+
+/* Padded to 8 bytes. The type is stored last, so a capture that was never
+ * closed still ends at the first record that reads CAPTURE_END. */
+struct CaptureRecord {
+	/* Since the capture was opened */
+	uint64_t time_ns;
+	uint16_t length;
+	uint8_t interface;
+	uint8_t id;
+	uint32_t type;
+	uint8_t data[];
+};
+
+/* An append-only capture file mapped into memory. Records are reserved with
+ * a single atomic add, so any thread can record without taking a lock. */
+struct Capture {
+	int fd;
+	bool writable;
+	uint8_t* map;
+	size_t size;
+	struct CaptureHeader* header;
+	uint64_t start_ns;
+	uint64_t tail;
+	uint64_t dropped;
+};
+
+bool capture_open(struct Capture*, const char* path, const struct DeviceProfile*);
+bool capture_load(struct Capture*, const char* path);
+void capture_close(struct Capture*);
+void capture_record(struct Capture*, enum CaptureType, uint8_t interface, const uint8_t* data, size_t size, bool numbered, uint64_t time_ns);
+/* Returns the record at *offset and moves past it, or NULL at the end */
+const struct CaptureRecord* capture_next(const struct Capture*, uint64_t* offset);
+
+/* Plays the input reports of a capture back as the device, through one
+ * socket per gadget interface, while discarding whatever the host sends */
+struct Replay {
+	const struct Capture* capture;
+	/* Replay end first, then the loop end until replay_socket hands it out */
+	int sockets[INTERFACES_MAX][2];
+	bool fast;
+	bool stop;
+	bool* done;
+	pthread_t thread;
+	/* Set while the replay thread runs */
+	struct Loop* loop;
+	struct LoopSource finished;
+	uint64_t reports;
+	uint64_t late_ns;
+};
+
+bool replay_init(struct Replay*, const struct Capture*, bool fast);
+/* The loop side of interface's socket, owned by the caller from then on */
+int replay_socket(struct Replay*, int interface);
+void replay_prime_features(const struct Replay*, struct Interface*);
+/* Sets *done and stops the loop once the whole capture was played */
+bool replay_start(struct Replay*, struct Loop*, bool* done);
+void replay_stop(struct Replay*);
+void replay_free(struct Replay*);
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+#include "options.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#define CONTROL_CLIENTS_MAX 4
+#define CONTROL_MAGIC "HIDSTAT"
+#define CONTROL_VERSION 1
+
+struct Session;
+
+struct ControlDirection {
+	uint64_t reports;
+	uint64_t bytes;
+	/* Times the sink returned EAGAIN */
+	uint64_t stalls;
+	uint64_t short_writes;
+	/* Including a stall still going on */
+	uint64_t stalled_ns;
+	uint64_t coalesced;
+	uint64_t dropped;
+	uint64_t invalid;
+	/* UINT64_MAX until the first report */
+	uint64_t last_report_age_ns;
+};
+
+/* Answer to "stats": a ControlHeader, then a ControlRecord per interface,
+ * all in host byte order */
+struct ControlHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t records;
+	uint32_t record_size;
+	uint32_t reserved;
+	/* CLOCK_MONOTONIC */
+	uint64_t time_ns;
+	/* Log messages lost to a full log queue, for the whole process */
+	uint64_t log_dropped;
+};
+
+struct ControlRecord {
+	uint32_t session;
+	uint32_t interface;
+	uint64_t detached;
+	struct ControlDirection input;
+	struct ControlDirection output;
+	uint64_t feature_transactions;
+	uint64_t feature_failures;
+	uint64_t feature_cache_hits;
+	/* The output worker's queue, see OutputStats */
+	uint64_t output_queued;
+	uint64_t output_written;
+	uint64_t output_failed;
+	uint64_t output_discarded;
+	uint64_t output_coalesced;
+	uint64_t output_depth_max;
+	uint64_t reattaches;
+	/* Input copied to each mirror, in the order the mirrors were added */
+	uint32_t mirrors;
+	uint32_t reserved;
+	struct ControlDirection mirror[MIRRORS_MAX];
+};
+
+struct Control;
+
+struct ControlClient {
+	struct LoopSource source;
+	struct Control* control;
+	/* Answer still to be sent */
+	char* buffer;
+	size_t size;
+	size_t sent;
+};
+
+/* A Unix socket answering with the live counters of every interface. Each
+ * connection sends one command, "stats" for the binary form or "metrics" (or
+ * nothing at all) for Prometheus text, and is closed once it is answered.
+ * Counters are read with relaxed loads, so the forwarding threads never
+ * wait on a query. */
+struct Control {
+	struct LoopSource source;
+	struct Loop* loop;
+	char path[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
+	const struct Session* sessions;
+	int count;
+	struct ControlClient clients[CONTROL_CLIENTS_MAX];
+};
+
+bool control_init(struct Control*, struct Loop*, const char* path, const struct Session* sessions, int count);
+void control_free(struct Control*);
@@ -9,3 +9,4 @@ int find_dev_node(unsigned nod_major, unsigned nod_minor, const char* prefix);
 int find_dev(const char* file, const char* class);
 bool find_dev_by_id(const char* vidpid, char* out);
 int find_hidraw(const char* syspath);
+bool find_hid_sysfs_path(const char* hidraw, char* syspath);
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "hidg.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct Endpoint;
+
+/* How reports are moved through an endpoint. Readiness always comes from
+ * polling the endpoint's fd, so every implementation needs one. Failing calls
+ * leave the reason in errno, like the system calls they wrap. */
+struct EndpointOps {
+	const char* name;
+	ssize_t (*read)(struct Endpoint*, void* data, size_t size);
+	ssize_t (*write)(struct Endpoint*, const void* data, size_t size);
+
+	/* Device side: feature reports, report number first */
+	bool (*set_feature)(struct Endpoint*, const uint8_t* data, size_t size);
+	bool (*get_feature)(struct Endpoint*, uint8_t* data, size_t size);
+
+	/* Host side: the SET_REPORT the host is waiting on, and the answer to it */
+	bool (*read_set_report)(struct Endpoint*, struct usb_hidg_report*);
+	bool (*write_get_report)(struct Endpoint*, const struct usb_hidg_report*);
+};
+
+extern const struct EndpointOps hidraw_ops;
+extern const struct EndpointOps hidg_ops;
+
+/* Stands in for either side with a socket, such as one end of a SOCK_SEQPACKET
+ * socketpair, so the data path can run without a device or a UDC. Feature
+ * reads answer with zeroes and the host never sends feature reports. */
+extern const struct EndpointOps socket_ops;
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "hidg.h"
+#include "hist.h"
+#include "loop.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FEATURE_REQUESTS_MAX 16
+
+struct Endpoint;
+struct Interface;
+struct Mirror;
+struct ReportTable;
+
+enum FeaturePolicy {
+	FEATURE_DEFAULT,
+	/* Always read the answer from the device */
+	FEATURE_FORWARD,
+	/* Answer from the copy read at startup */
+	FEATURE_STATIC,
+	/* Answer from the copy read at startup, replaced by what the host writes */
+	FEATURE_WRITE_THROUGH,
+};
+
+struct FeatureEntry {
+	uint8_t policy;
+	bool valid;
+	uint16_t length;
+	uint8_t data[64];
+};
+
+struct FeatureCache {
+	/* Indexed like ReportTable.reports */
+	struct FeatureEntry* entries;
+	const struct ReportTable* reports;
+	/* The static entries as they were before forwarding started, which
+	 * mirror hosts are answered from. Never written once taken, so the loop
+	 * thread can read it while the worker owns the entries. */
+	struct FeatureEntry* snapshot;
+};
+
+struct FeatureRequest {
+	struct FeatureRequest* next;
+	struct Interface* iface;
+	struct usb_hidg_report set_report;
+	struct usb_hidg_report get_report;
+	/* Re-read the cache from the device rather than forward a transfer */
+	bool refresh;
+	bool ok;
+	bool cached;
+	uint64_t queued_ns;
+	uint64_t started_ns;
+	uint64_t done_ns;
+};
+
+struct FeatureStats {
+	uint64_t transactions;
+	uint64_t failures;
+	uint64_t cache_hits;
+	/* Failed right away because every request was in use. Counted by the
+	 * thread forwarding the interface, the others by the loop thread. */
+	uint64_t refused;
+	/* From the host's SET_REPORT to the GET_REPORT answer being posted */
+	struct Hist latency;
+	/* Time spent in the hidraw ioctls alone */
+	struct Hist device;
+};
+
+struct FeatureList {
+	struct FeatureRequest* head;
+	struct FeatureRequest* tail;
+};
+
+/* Feature reports are forwarded by a worker thread, since each hidraw feature
+ * ioctl is a full control transfer on the physical device. SET_REPORT data is
+ * read from hidg on the loop thread, handed to the worker, and the resulting
+ * GET_REPORT answer is posted back to hidg on the loop thread once the worker
+ * signals completion through an eventfd. */
+struct FeatureWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Signalled whenever a request is done with the device */
+	pthread_cond_t idle;
+	bool stop;
+	struct FeatureList pending;
+	struct FeatureList done;
+	/* Being worked on, outside the lock */
+	struct FeatureRequest* current;
+	/* Taken from by every forwarding thread, given back to on the loop
+	 * thread */
+	struct FeatureList free;
+
+	/* Only touched on the loop thread */
+	struct LoopSource source;
+	struct Loop* loop;
+	struct FeatureRequest requests[FEATURE_REQUESTS_MAX];
+};
+
+bool feature_init(struct FeatureWorker*, struct Loop*);
+void feature_free(struct FeatureWorker*);
+void feature_submit(struct FeatureWorker*, struct Interface*);
+void feature_refresh(struct FeatureWorker*, struct Interface*);
+/* Fails what is queued for the interface and waits out a transfer in
+ * progress, so its device can be closed */
+void feature_cancel(struct FeatureWorker*, struct Interface*);
+void feature_answer_mirror(struct Mirror*);
+
+bool feature_cache_init(struct FeatureCache*, const struct ReportTable*, const uint8_t* policies, enum FeaturePolicy fallback);
+void feature_cache_free(struct FeatureCache*);
+void feature_cache_prefetch(struct FeatureCache*, struct Endpoint* hidraw);
+void feature_cache_invalidate(struct FeatureCache*, uint8_t id);
+/* Before the worker starts */
+bool feature_cache_snapshot(struct FeatureCache*);
+/* Seeds the cache with a known answer, report number first */
+void feature_cache_store(struct FeatureCache*, const uint8_t* data, size_t size);
+bool feature_policy_parse(const char* name, enum FeaturePolicy*);
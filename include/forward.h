@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "endpoint.h"
+#include "feature.h"
+#include "hidg.h"
+#include "hist.h"
+#include "loop.h"
+#include "output.h"
+#include "queue.h"
+#include "report.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Capture;
+struct Direction;
+struct Interface;
+
+struct Endpoint {
+	struct LoopSource source;
+	/* forward_init picks the real device; swap it before forward_attach to
+	 * run the interface against a stand-in */
+	const struct EndpointOps* ops;
+	struct Interface* iface;
+	/* Direction this endpoint is read for, and the one it is written for */
+	struct Direction* reader;
+	struct Direction* writer;
+	uint32_t extra_events;
+	bool readable;
+};
+
+enum DirectionState {
+	FLOWING,
+	BLOCKED,
+};
+
+struct DirectionStats {
+	uint64_t reports;
+	uint64_t bytes;
+	uint64_t stalls;
+	uint64_t stalled_ns;
+	uint64_t stalled_max_ns;
+	/* Reports whose size does not match the report descriptor */
+	uint64_t invalid;
+	/* Writes the sink cut off partway */
+	uint64_t short_writes;
+	/* When the sink last took a report */
+	uint64_t last_ns;
+};
+
+/* Both measured from the loop wakeup that found the source readable */
+struct DirectionLatency {
+	/* Until the report was read */
+	struct Hist read;
+	/* Until the sink accepted it, including any time spent queued */
+	struct Hist total;
+};
+
+/* One way of traffic between two endpoints. While the sink refuses writes the
+ * direction is BLOCKED and the sink is polled for output instead. Input keeps
+ * being read into the queue meanwhile, since the device's hidraw ring would
+ * drop the newest reports once full; output from the host is left in the
+ * source until the device catches up. Once unblocked, whatever piled up is
+ * staged in the queue first, so the sink is handed the freshest report per
+ * ID. */
+struct Direction {
+	const char* name;
+	enum ReportType type;
+	struct Endpoint* source;
+	struct Endpoint* sink;
+	enum DirectionState state;
+	uint64_t blocked_since;
+	struct DirectionStats stats;
+	struct DirectionLatency latency;
+
+	/* Reports read from the source that the sink has not accepted yet */
+	struct ReportQueue queue;
+	uint8_t buffer[REPORT_SIZE_MAX];
+};
+
+/* Another host that gets a copy of every input report, through its own queue
+ * and backpressure: a stalled mirror only loses its own reports, and never
+ * holds up the primary host or the others. Output and feature reports belong
+ * to the primary host, so the device only ever hears from one of them. */
+struct Mirror {
+	char name[16];
+	struct Endpoint hidg;
+	struct Direction input;
+	/* Never written anywhere, only there to read what the host sends */
+	struct Direction output;
+	uint64_t discarded;
+	uint64_t features;
+};
+
+struct Interface {
+	int index;
+	struct Loop* loop;
+	struct Endpoint hidraw;
+	struct Endpoint hidg;
+	struct Direction input;
+	struct Direction output;
+	struct ReportTable reports;
+	struct FeatureWorker* feature_worker;
+	struct FeatureCache feature_cache;
+	struct FeatureStats feature_stats;
+	struct Mirror* mirrors;
+	int nmirrors;
+	/* Records every report read, if set */
+	struct Capture* capture;
+	/* Output reports on their way to the device, once forward_dispatch_output
+	 * hands them to a worker */
+	struct OutputQueue dispatch;
+
+	/* Wait for the device to come back after it disconnects instead of
+	 * stopping, with host output held back in the meantime */
+	bool reattach;
+	bool detached;
+	uint64_t detached_ns;
+	uint64_t reattaches;
+};
+
+/* With hidraw -1 the interface starts detached, waiting for forward_reattach */
+bool forward_init(struct Interface*, int index, int hidraw, int hidg, const struct ReportTable*);
+/* Takes ownership of the hidg fds, even on failure */
+bool forward_init_mirrors(struct Interface*, const int* hidg, int count);
+/* For --realtime, once the queues are set up: reserves room for any report an
+ * unnumbered device sends and keeps the queues from allocating on the
+ * forwarding path, dropping a report that would need it */
+bool forward_freeze(struct Interface*);
+/* Before forward_attach: write output reports from the worker thread */
+bool forward_dispatch_output(struct Interface*, struct OutputWorker*);
+bool forward_attach(struct Interface*, struct Loop*, struct FeatureWorker*);
+bool forward_reattach(struct Interface*, int hidraw);
+void forward_close(struct Interface*);
+void forward_log_stats(const struct Interface*);
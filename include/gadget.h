@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "profile.h"
+#include "report.h"
+
+#include <stdbool.h>
+
+/* Builds the configfs gadget for a profile, filling in the report table of
+ * every HID interface from its descriptor */
+bool gadget_create(const char* configfs, const struct DeviceProfile*, struct ReportTable* reports);
+void gadget_remove(const char* configfs, int interfaces);
+/* Whether a gadget left by an earlier run was built from the same profile, so
+ * it can be taken over without the host seeing it go away */
+bool gadget_matches(const char* configfs, const struct DeviceProfile*);
+/* Fills in the report tables gadget_create would have for a matching gadget */
+void gadget_adopt(const struct DeviceProfile*, struct ReportTable* reports);
+/* The UDC the gadget is bound to, false if it is not bound */
+bool gadget_udc(const char* configfs, char* out);
+
+/* Returns true for UDCs find_udc should pass over */
+typedef bool (*udc_filter)(void* data, const char* udc);
+
+bool find_udc(char* out, udc_filter taken, void* data);
+bool start_udc(const char* configfs, const char* udc);
+bool stop_udc(const char* configfs);
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <linux/ioctl.h>
+#include <stdint.h>
+
+#define REPORT_SIZE_MAX 4096
+
+struct usb_hidg_report {
+	uint16_t length;
+	uint8_t data[64];
+};
+
+#define GADGET_HID_READ_SET_REPORT	_IOR('g', 0x41, struct usb_hidg_report)
+#define GADGET_HID_WRITE_GET_REPORT	_IOW('g', 0x42, struct usb_hidg_report)
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <stdint.h>
+
+/* Log-linear histogram of nanosecond durations: values are exact below
+ * 2 << HIST_SUB_BITS and otherwise kept to within 1 / (1 << HIST_SUB_BITS)
+ * of their value, up to 1 << HIST_MAX_BITS ns (about 18 minutes). */
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct Hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct Hist*, uint64_t ns);
+uint64_t hist_percentile(const struct Hist*, double percentile);
+void hist_log(const struct Hist*, const char* label);
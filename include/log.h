@@ -1,6 +1,9 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 enum LogLevel {
 	DEBUG = 3,
 	INFO = 2,
@@ -13,3 +16,14 @@ void log_fmt(enum LogLevel, const char* fmt, ...);
 void log_errno(enum LogLevel, const char* msg);
 
 void set_log_level(enum LogLevel);
+
+/* From here on messages are queued with their raw arguments and written out
+ * by a thread of their own, so a caller never waits on stderr. Warnings and
+ * errors are limited per call site, and a full queue drops messages rather
+ * than blocking; both are summed up in the log once they stop. Until then,
+ * and after log_stop, messages are written as they come. */
+bool log_start(void);
+/* Writes out everything still queued */
+void log_stop(void);
+/* Messages lost to a full queue */
+uint64_t log_dropped(void);
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct LoopSource;
+
+/* Returning false from a handler stops the loop with an error */
+typedef bool (*loop_handler)(struct LoopSource*, uint32_t events);
+
+struct LoopSource {
+	int fd;
+	uint32_t events;
+	loop_handler handler;
+	void* data;
+};
+
+/* How long busy polling spends its spin budget over */
+#define LOOP_SPIN_PERIOD_NS 1000000000ULL
+
+struct LoopSpinStats {
+	uint64_t spins;
+	/* Spins that caught an event before their window closed */
+	uint64_t wins;
+	/* Spins skipped because the budget for the period was spent */
+	uint64_t throttled;
+	uint64_t spin_ns;
+};
+
+/* Busy polling: after a report comes in, the loop keeps polling without
+ * sleeping until the next one is due, as long as reports come in often
+ * enough to be worth it and the loop stays within its CPU budget */
+struct LoopSpin {
+	/* Longest the loop spins for, or 0 to always sleep */
+	uint64_t window_ns;
+	/* Spinning allowed per LOOP_SPIN_PERIOD_NS */
+	uint64_t budget_ns;
+	/* Moving average of the time between reports */
+	uint64_t interval_ns;
+	uint64_t last_report_ns;
+	/* A report came in since the loop last decided whether to spin */
+	bool reported;
+	uint64_t period_start;
+	uint64_t period_spent;
+	struct LoopSpinStats stats;
+};
+
+struct Loop {
+	int epfd;
+	/* When the current batch of events was returned */
+	uint64_t woken_ns;
+	struct LoopSpin spin;
+};
+
+bool loop_init(struct Loop*);
+void loop_free(struct Loop*);
+bool loop_add(struct Loop*, struct LoopSource*);
+bool loop_mod(struct Loop*, struct LoopSource*, uint32_t events);
+void loop_del(struct Loop*, struct LoopSource*);
+bool loop_dispatch(struct Loop*, int timeout);
+bool loop_run(struct Loop*, const bool* stop);
+
+/* Spins for up to window_ns after each report, for at most budget percent of
+ * the time */
+void loop_busy_poll(struct Loop*, uint64_t window_ns, unsigned budget);
+/* Called by handlers for each report read, to time the spin window */
+void loop_report(struct Loop*);
+void loop_log_stats(const struct Loop*);
+
+/* Handler for sources that only exist to wake the loop up and stop it */
+bool loop_stop_handler(struct LoopSource*, uint32_t events);
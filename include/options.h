@@ -3,12 +3,64 @@
 
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define CPUS_MAX 64
+/* Percent of the time --busy-poll may spin for by default */
+#define BUSY_POLL_BUDGET 50
+#define MIRRORS_MAX 4
 
 struct Options {
-	char* dev;
+	/* One session per device, each on the UDC given after an @ if any */
+	char** devs;
+	char** udcs;
+	int ndevs;
 	char* name;
 	char* udc;
 	bool usage;
+	/* Input report IDs that are queued in order rather than coalesced */
+	bool fifo_ids[256];
+	/* Output report IDs that only keep the latest report while the device is busy */
+	bool latest_ids[256];
+	/* enum FeaturePolicy, per feature report ID and for unlisted IDs */
+	uint8_t feature_policies[256];
+	uint8_t feature_policy;
+	/* Run each interface on its own thread */
+	bool threads;
+	int cpus[CPUS_MAX];
+	int ncpus;
+	int priority;
+	/* Move reports with io_uring instead of epoll */
+	bool io_uring;
+	/* Log how long each step of the gadget setup took */
+	bool timing;
+	/* Pass all devices through as one gadget */
+	bool composite;
+	/* UDCs of further gadgets that get a copy of the input */
+	char* mirrors[MIRRORS_MAX];
+	int nmirrors;
+	/* Write every report to this capture file */
+	char* record;
+	/* Drive the gadget from this capture instead of a device */
+	char* replay;
+	bool replay_fast;
+	/* Build the gadget from a saved profile, and save one */
+	char* profile;
+	char* save_profile;
+	/* Keep the gadget up while the device is unplugged */
+	bool reattach;
+	/* and after exiting */
+	bool keep_gadget;
+	/* Unix socket to serve statistics on */
+	char* control;
+	/* Lock memory and forward with realtime priority */
+	bool realtime;
+	/* Seconds to measure scheduling latency for instead of forwarding */
+	unsigned jitter_test;
+	/* Longest to spin after each input report, and the share of the time
+	 * spinning may take up */
+	unsigned busy_poll_us;
+	unsigned busy_poll_budget;
 };
 
 bool getopt_parse(int argc, char* argv[], struct Options*);
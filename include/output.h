@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "hidg.h"
+#include "hist.h"
+#include "loop.h"
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Reports handed to the worker and not written yet, per interface */
+#define OUTPUT_QUEUE_MAX REPORT_FIFO_DEPTH
+
+struct Interface;
+struct OutputWorker;
+
+struct OutputStats {
+	uint64_t queued;
+	uint64_t written;
+	uint64_t failed;
+	/* Discarded because the device went away before they were written */
+	uint64_t discarded;
+	/* Depth each report found the queue at, summed for the average */
+	uint64_t depth_sum;
+	uint64_t depth_max;
+	/* From being queued until the device took it */
+	struct Hist latency;
+	/* Time spent in the hidraw write alone */
+	struct Hist device;
+};
+
+/* A report waiting in an OutputQueue */
+struct OutputEntry {
+	uint64_t stamp;
+	uint16_t length;
+	uint8_t id;
+};
+
+/* Output reports on their way to one interface's device, written in the
+ * order the host sent them whatever their report ID. Report IDs in
+ * REPORT_LATEST mode only keep the newest report, which replaces the one
+ * waiting where it sits, so a host streaming rumble does not build up a
+ * backlog. */
+struct OutputQueue {
+	struct OutputQueue* next;
+	struct OutputWorker* worker;
+	struct Interface* iface;
+	bool numbered;
+	uint8_t modes[REPORT_IDS];
+
+	/* Guarded by the worker lock */
+	struct OutputEntry entries[OUTPUT_QUEUE_MAX];
+	/* REPORT_SIZE_MAX bytes per entry, allocated up front */
+	uint8_t* data;
+	unsigned head;
+	unsigned depth;
+	uint64_t coalesced;
+	/* Waiting in the worker's list */
+	bool scheduled;
+	bool writing;
+	/* The loop was turned away and waits for the worker to make room */
+	bool full;
+	struct OutputStats stats;
+
+	/* Signalled by the worker once a full queue has room again */
+	struct LoopSource source;
+	/* Only touched on the worker thread */
+	uint8_t buffer[REPORT_SIZE_MAX];
+};
+
+/* Output reports are written by a worker thread, since a hidraw write is a
+ * whole transfer on the physical device and would otherwise hold up input
+ * forwarding on the loop thread for as long as it takes. */
+struct OutputWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Signalled whenever a write finishes */
+	pthread_cond_t idle;
+	bool stop;
+	/* Queues with reports to write, served in turn */
+	struct OutputQueue* head;
+	struct OutputQueue* tail;
+};
+
+bool output_init(struct OutputWorker*);
+void output_free(struct OutputWorker*);
+
+/* Queues every report ID in the mode it has in like */
+bool output_queue_init(struct OutputQueue*, struct OutputWorker*, struct Interface*, const struct ReportQueue* like);
+/* Only once the worker is stopped */
+void output_queue_free(struct OutputQueue*);
+/* Returns size once queued, or -1 with errno EAGAIN while the queue is full */
+ssize_t output_push(struct OutputQueue*, const uint8_t* data, size_t size, uint64_t stamp);
+/* Throws away what is queued and waits out a write in progress, so the device
+ * can be closed */
+void output_discard(struct OutputQueue*);
+void output_log_stats(const struct OutputQueue*);
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define INTERFACES_MAX 8
+#define DESCRIPTOR_SIZE_MAX 4096
+#define PROFILE_STRING_MAX 128
+#define PROFILE_FEATURE_SIZE_MAX 64
+
+struct InterfaceProfile {
+	bool hid;
+	uint8_t subclass;
+	uint8_t protocol;
+	uint16_t descriptor_size;
+	uint8_t descriptor[DESCRIPTOR_SIZE_MAX];
+};
+
+/* Everything the gadget is built from, read from the source device in one
+ * pass so that creating the gadget does not have to go back to sysfs */
+struct DeviceProfile {
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t bcd_device;
+	uint16_t bcd_usb;
+	uint8_t device_subclass;
+	uint8_t device_protocol;
+	/* In mA */
+	uint16_t max_power;
+	/* Empty if the source does not have them */
+	char manufacturer[PROFILE_STRING_MAX];
+	char product[PROFILE_STRING_MAX];
+	char serial[PROFILE_STRING_MAX];
+	char configuration[PROFILE_STRING_MAX];
+	int interfaces;
+	struct InterfaceProfile interface[INTERFACES_MAX];
+};
+
+/* A feature report answer kept with a saved profile, report number first */
+struct ProfileFeature {
+	uint8_t interface;
+	uint8_t length;
+	uint8_t data[PROFILE_FEATURE_SIZE_MAX];
+};
+
+bool profile_read_usb(struct DeviceProfile*, const char* syspath, const char* bus_id);
+bool profile_read_hid(struct DeviceProfile*, const char* syspath);
+/* Appends the HID interfaces of source to composite, in order. The first
+ * profile merged into an empty composite is taken whole, identity included. */
+bool profile_merge(struct DeviceProfile* composite, const struct DeviceProfile* source);
+
+/* Profile files hold only what the gadget is built from, in a fixed byte
+ * order, so they can be kept across builds and machines */
+bool profile_save(const char* path, const struct DeviceProfile*, const struct ProfileFeature* features, int count);
+/* Features are allocated, to be freed by the caller */
+bool profile_load(const char* path, struct DeviceProfile*, struct ProfileFeature** features, int* count);
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPORT_IDS 256
+#define REPORT_FIFO_DEPTH 16
+
+enum ReportMode {
+	REPORT_LATEST,
+	REPORT_FIFO,
+};
+
+/* Staged reports for a single report ID. In REPORT_LATEST mode only the most
+ * recent report is kept; in REPORT_FIFO mode up to REPORT_FIFO_DEPTH reports
+ * are kept in order and the oldest is dropped on overflow. */
+struct ReportSlot {
+	struct ReportSlot* next;
+	enum ReportMode mode;
+	bool queued;
+	uint8_t head;
+	uint8_t count;
+	size_t stride;
+	uint16_t lengths[REPORT_FIFO_DEPTH];
+	uint64_t stamps[REPORT_FIFO_DEPTH];
+	uint8_t* data;
+};
+
+struct ReportQueue {
+	bool numbered;
+	uint8_t modes[REPORT_IDS];
+	struct ReportSlot* slots[REPORT_IDS];
+	/* Slots with staged reports, in the order they became non-empty */
+	struct ReportSlot* head;
+	struct ReportSlot* tail;
+	uint64_t coalesced;
+	uint64_t dropped;
+	/* Reports that would need a slot allocated or grown are dropped instead */
+	bool frozen;
+};
+
+void queue_init(struct ReportQueue*, bool numbered, enum ReportMode mode);
+void queue_free(struct ReportQueue*);
+bool queue_reserve(struct ReportQueue*, uint8_t id, size_t size);
+bool queue_set_mode(struct ReportQueue*, uint8_t id, enum ReportMode mode);
+bool queue_push(struct ReportQueue*, const uint8_t* data, size_t size, uint64_t stamp);
+const uint8_t* queue_peek(const struct ReportQueue*, size_t* size, uint64_t* stamp);
+void queue_pop(struct ReportQueue*);
+/* Nothing is allocated for the queue from here on */
+void queue_freeze(struct ReportQueue*);
+
+static inline bool queue_empty(const struct ReportQueue* queue) {
+	return !queue->head;
+}
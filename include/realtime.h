@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* SCHED_FIFO priority for --realtime when --priority is not given */
+#define REALTIME_PRIORITY 50
+/* Period of the --jitter-test wakeups */
+#define JITTER_INTERVAL_US 1000
+
+struct ThreadConfig;
+
+/* Watches over a --realtime process once it is up: from then on forwarding
+ * should neither fault pages in from disk nor need more memory for the heap */
+struct Realtime {
+	struct LoopSource source;
+	/* Taken at the first check, once startup is well over */
+	bool baseline;
+	uint64_t major_faults;
+	uint64_t minor_faults;
+	size_t heap;
+	/* What was last warned about */
+	uint64_t reported_faults;
+	size_t reported_heap;
+};
+
+/* Right after the options are parsed, before any thread is started or
+ * anything but the option strings is allocated: keeps every thread on one
+ * heap that never hands memory back, so what startup allocated stays locked */
+void realtime_prepare(void);
+/* Locks and prefaults the memory of the process */
+bool realtime_lock(void);
+/* Locks memory and checks on it from then on */
+bool realtime_start(struct Realtime*, struct Loop*);
+void realtime_free(struct Realtime*, struct Loop*);
+
+/* Sleeps until each wakeup is due, interval_us apart, for seconds and logs
+ * how late the wakeups were, to qualify a board and kernel */
+bool realtime_jitter_test(const struct ThreadConfig*, unsigned seconds, unsigned interval_us, const bool* stop);
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum ReportType {
+	REPORT_INPUT,
+	REPORT_OUTPUT,
+	REPORT_FEATURE,
+	REPORT_TYPES
+};
+
+struct ReportInfo {
+	uint8_t id;
+	/* Payload size in bytes for each type, not counting the report ID */
+	uint16_t size[REPORT_TYPES];
+};
+
+struct ReportTable {
+	bool numbered;
+	uint16_t count;
+	/* Report ID to position in reports + 1, or 0 if the ID is not declared */
+	uint16_t index[256];
+	struct ReportInfo reports[256];
+};
+
+bool report_parse(struct ReportTable*, const uint8_t* desc, size_t size);
+size_t report_size(const struct ReportTable*, enum ReportType, uint8_t id);
+size_t report_max_size(const struct ReportTable*, enum ReportType);
+bool report_valid(const struct ReportTable*, enum ReportType, const uint8_t* data, size_t size);
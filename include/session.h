@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "forward.h"
+#include "options.h"
+#include "profile.h"
+#include "report.h"
+#include "uevent.h"
+
+#include <limits.h>
+#include <stdbool.h>
+
+/* A device whose interfaces the gadget forwards */
+struct SessionSource {
+	const char* dev;
+	char syspath[PATH_MAX];
+	char bus_id[32];
+	bool hid_source;
+	/* Built from a saved profile, so the device is attached whenever it
+	 * shows up rather than needed up front */
+	bool offline;
+};
+
+/* Where a gadget interface is forwarded to */
+struct InterfaceRoute {
+	int source;
+	/* Interface number on the source device */
+	int number;
+};
+
+struct Replay;
+
+struct SessionGadget {
+	char name[NAME_MAX + 1];
+	/* Empty until session_create picks one */
+	char udc[PATH_MAX];
+	char configfs[PATH_MAX];
+	bool created;
+	bool bound;
+};
+
+/* One gadget on its own UDC, passing through one device or, as a composite,
+ * the interfaces of several. Mirrors are further gadgets built from the same
+ * profile, each on a UDC of its own, that get a copy of the input. */
+struct Session {
+	/* The primary gadget first, then the mirrors */
+	struct SessionGadget gadget[1 + MIRRORS_MAX];
+	int ngadgets;
+	struct SessionSource* sources;
+	int nsources;
+	/* Plays a capture back in place of the sources */
+	struct Replay* replay;
+	/* Feature answers from a saved profile, seeded into the caches */
+	struct ProfileFeature* features;
+	int nfeatures;
+	/* Merged from all sources, so gadget interfaces are numbered in the
+	 * order the sources were added */
+	struct DeviceProfile profile;
+	struct InterfaceRoute route[INTERFACES_MAX];
+	/* Indexed by gadget interface number */
+	struct ReportTable* reports;
+	/* Slice of the interface table shared by all sessions, HID interfaces
+	 * only, filled in by session_open */
+	struct Interface* interfaces;
+	int count;
+	/* One per source, so a device that stops taking output reports only
+	 * holds up its own interfaces; a replay has a single one */
+	struct OutputWorker* outputs;
+	int noutputs;
+	/* Leave the gadgets bound on exit, for the next run to take over */
+	bool keep;
+};
+
+void session_init(struct Session*, const char* name, const char* udc);
+/* Reads the profile from the device, unless one is given */
+bool session_add_source(struct Session*, const char* dev, const struct DeviceProfile*);
+bool session_load_profile(struct Session*, const char* dev, const char* path);
+bool session_save_profile(const struct Session*, const char* path);
+/* Takes the profile from the capture being replayed */
+void session_replay(struct Session*, struct Replay*);
+void session_add_mirror(struct Session*, const char* udc);
+int session_hid_interfaces(const struct Session*);
+/* Builds and binds the gadgets, skipping UDCs taken by any of the sessions.
+ * A gadget an earlier run left with the same profile is taken over as is. */
+bool session_create(struct Session*, const struct Session* sessions, int count);
+bool session_open(struct Session*, struct Interface* interfaces, const struct Options*);
+/* Starts the output workers and hands each interface to its source's */
+bool session_start_output(struct Session*);
+void session_stop_output(struct Session*);
+bool session_reattach(struct Session*, const struct Uevent*);
+void session_log_stats(const struct Session*);
+void session_free(struct Session*);
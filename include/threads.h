@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct FeatureWorker;
+struct Interface;
+
+struct ThreadConfig {
+	/* CPU to pin to, or -1 to leave affinity alone */
+	int cpu;
+	/* SCHED_FIFO priority, or 0 to keep the default policy */
+	int priority;
+	/* Longest the loop spins for after a report, or 0 to always sleep */
+	uint64_t busy_poll_ns;
+	/* Percent of the time it may spend spinning */
+	unsigned busy_poll_budget;
+};
+
+/* A forwarding loop for a single interface on its own thread */
+struct ForwardThread {
+	pthread_t thread;
+	struct Loop loop;
+	struct LoopSource shutdown;
+	struct Interface* iface;
+	struct ThreadConfig config;
+	const bool* stop;
+	bool ok;
+};
+
+bool thread_configure(const struct ThreadConfig*);
+bool thread_spawn(pthread_t*, void* (*fn)(void*), void* arg);
+
+bool forward_thread_start(struct ForwardThread*, struct Interface*, struct FeatureWorker*,
+                          int shutdown_fd, const bool* stop, const struct ThreadConfig*);
+bool forward_thread_join(struct ForwardThread*);
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+
+#include <stdbool.h>
+
+#define UEVENT_SIZE_MAX 8192
+
+struct Uevent {
+	const char* action;
+	const char* devpath;
+	const char* subsystem;
+	/* Node name under /dev, or NULL if the device has none */
+	const char* devname;
+};
+
+/* Returning false stops the loop with an error */
+typedef bool (*uevent_handler)(void* data, const struct Uevent*);
+
+/* Kernel uevents, read straight off netlink rather than waiting for udev to
+ * process and rebroadcast them */
+struct UeventMonitor {
+	struct LoopSource source;
+	uevent_handler handler;
+	void* data;
+	char buffer[UEVENT_SIZE_MAX];
+};
+
+bool uevent_init(struct UeventMonitor*, struct Loop*, uevent_handler, void* data);
+void uevent_free(struct UeventMonitor*, struct Loop*);
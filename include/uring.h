@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#pragma once
+
+#include "loop.h"
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Direction;
+struct Interface;
+
+enum UringOpType {
+	URING_READ,
+	URING_WRITE,
+	URING_FEATURE,
+	URING_LOOP,
+};
+
+struct UringOp {
+	enum UringOpType type;
+	struct UringStream* stream;
+	struct Interface* iface;
+};
+
+/* One direction of an interface driven by chained read and write requests */
+struct UringStream {
+	struct Direction* dir;
+	int source;
+	int sink;
+	int buffer;
+	/* Read size that lets the write be linked to the read, or 0 if
+	 * reports in this direction vary in size */
+	size_t linked;
+	size_t length;
+	/* When the pending report's read completed */
+	uint64_t read_ns;
+	struct UringOp read;
+	struct UringOp write;
+};
+
+/* io_uring engine for the data path. Reports are moved with registered
+ * buffers and files, one read and write in flight per direction, while feature
+ * reports and the auxiliary sources in the regular loop are watched with
+ * multishot polls. */
+struct Uring {
+	int fd;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned sq_entries;
+	unsigned queued;
+
+	struct Loop* loop;
+	struct UringOp loop_op;
+	struct Interface* interfaces;
+	struct UringStream* streams;
+	struct UringOp* features;
+	int count;
+};
+
+bool uring_init(struct Uring*, struct Interface*, int count, struct Loop*);
+bool uring_run(struct Uring*, const bool* stop);
+void uring_free(struct Uring*);
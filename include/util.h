@@ -2,8 +2,23 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
-__attribute__((format(printf, 1, 3))) int vmkdir(const char* pattern, int mode, ...);
 __attribute__((format(printf, 1, 4))) int vopen(const char* pattern, int flags, int mode, ...);
-bool cp_prop(const char* restrict indir, const char* inpath, const char* restrict outdir, const char* outpath);
-bool cp_prop_hex(const char* restrict indir, const char* inpath, const char* restrict outdir, const char* outpath);
+bool set_nonblock(int fd);
+uint64_t now_ns(void);
+
+/* Every counter has a single writer, the thread that owns what it counts.
+ * Relaxed stores keep concurrent readers such as the control socket from
+ * seeing torn values, without making the writer pay for a locked add. */
+static inline void counter_add(uint64_t* counter, uint64_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void counter_set(uint64_t* counter, uint64_t value) {
+	__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "capture.h"
+#include "feature.h"
+#include "forward.h"
+#include "log.h"
+#include "threads.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_ALIGN 8
+/* Longest a replay sleeps before checking whether it should stop */
+#define REPLAY_SLEEP_MAX_NS 100000000ULL
+
+static size_t records_offset(void) {
+	return (sizeof(struct CaptureHeader) + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+}
+
+static size_t record_size(size_t length) {
+	return (sizeof(struct CaptureRecord) + length + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+}
+
+bool capture_open(struct Capture* capture, const char* path, const struct DeviceProfile* profile) {
+	memset(capture, 0, sizeof(*capture));
+	capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0) {
+		log_errno(ERROR, "Failed to create capture");
+		return false;
+	}
+	capture->size = CAPTURE_SIZE_DEFAULT;
+	if (ftruncate(capture->fd, capture->size) < 0) {
+		log_errno(ERROR, "Failed to size capture");
+		goto close_fd;
+	}
+	capture->map = mmap(NULL, capture->size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+	if (capture->map == MAP_FAILED) {
+		log_errno(ERROR, "Failed to map capture");
+		capture->map = NULL;
+		goto close_fd;
+	}
+	capture->writable = true;
+	capture->header = (struct CaptureHeader*) capture->map;
+	memcpy(capture->header->magic, CAPTURE_MAGIC, sizeof(capture->header->magic));
+	capture->header->version = CAPTURE_VERSION;
+	capture->header->header_size = sizeof(*capture->header);
+	capture->header->profile = *profile;
+	capture->start_ns = now_ns();
+	return true;
+
+close_fd:
+	close(capture->fd);
+	return false;
+}
+
+bool capture_load(struct Capture* capture, const char* path) {
+	const struct CaptureHeader* header;
+	struct stat st;
+
+	memset(capture, 0, sizeof(*capture));
+	capture->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (capture->fd < 0) {
+		log_errno(ERROR, "Failed to open capture");
+		return false;
+	}
+	if (fstat(capture->fd, &st) < 0) {
+		log_errno(ERROR, "Failed to stat capture");
+		goto close_fd;
+	}
+	if ((size_t) st.st_size < records_offset()) {
+		log_fmt(ERROR, "Capture %s is truncated\n", path);
+		goto close_fd;
+	}
+	capture->size = st.st_size;
+	capture->map = mmap(NULL, capture->size, PROT_READ, MAP_PRIVATE, capture->fd, 0);
+	if (capture->map == MAP_FAILED) {
+		log_errno(ERROR, "Failed to map capture");
+		capture->map = NULL;
+		goto close_fd;
+	}
+	header = (const struct CaptureHeader*) capture->map;
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != CAPTURE_VERSION || header->header_size != sizeof(*header)) {
+		log_fmt(ERROR, "%s is not a capture this version can replay\n", path);
+		goto unmap;
+	}
+	capture->header = (struct CaptureHeader*) header;
+	/* A capture that was never closed runs up to its first empty record */
+	capture->tail = header->used ? header->used : capture->size - records_offset();
+	if (capture->tail > capture->size - records_offset()) {
+		capture->tail = capture->size - records_offset();
+	}
+	return true;
+
+unmap:
+	munmap(capture->map, capture->size);
+	capture->map = NULL;
+close_fd:
+	close(capture->fd);
+	return false;
+}
+
+void capture_close(struct Capture* capture) {
+	uint64_t used;
+
+	if (!capture->map) {
+		return;
+	}
+	if (capture->writable) {
+		used = capture->tail;
+		if (used > capture->size - records_offset()) {
+			used = capture->size - records_offset();
+		}
+		capture->header->used = used;
+		capture->header->dropped = capture->dropped;
+		log_fmt(INFO, "Captured %" PRIu64 " bytes of reports, %" PRIu64 " dropped\n", used, capture->dropped);
+		munmap(capture->map, capture->size);
+		if (ftruncate(capture->fd, records_offset() + used) < 0) {
+			log_errno(WARN, "Failed to trim capture");
+		}
+	} else {
+		munmap(capture->map, capture->size);
+	}
+	capture->map = NULL;
+	close(capture->fd);
+}
+
+void capture_record(struct Capture* capture, enum CaptureType type, uint8_t interface, const uint8_t* data, size_t size, bool numbered, uint64_t time_ns) {
+	size_t reserve = record_size(size);
+	struct CaptureRecord* record;
+	uint64_t offset;
+
+	offset = __atomic_fetch_add(&capture->tail, reserve, __ATOMIC_RELAXED);
+	if (offset + reserve > capture->size - records_offset()) {
+		__atomic_fetch_add(&capture->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	record = (struct CaptureRecord*) &capture->map[records_offset() + offset];
+	record->time_ns = time_ns - capture->start_ns;
+	record->length = size;
+	record->interface = interface;
+	record->id = numbered && size ? data[0] : 0;
+	memcpy(record->data, data, size);
+	__atomic_store_n(&record->type, type, __ATOMIC_RELEASE);
+}
+
+const struct CaptureRecord* capture_next(const struct Capture* capture, uint64_t* offset) {
+	const struct CaptureRecord* record;
+
+	if (*offset + sizeof(*record) > capture->tail) {
+		return NULL;
+	}
+	record = (const struct CaptureRecord*) &capture->map[records_offset() + *offset];
+	if (record->type == CAPTURE_END || *offset + record_size(record->length) > capture->tail) {
+		return NULL;
+	}
+	*offset += record_size(record->length);
+	return record;
+}
+
+bool replay_init(struct Replay* replay, const struct Capture* capture, bool fast) {
+	const struct DeviceProfile* profile = &capture->header->profile;
+	struct timeval timeout = {.tv_usec = REPLAY_SLEEP_MAX_NS / 1000};
+	int i;
+
+	memset(replay, 0, sizeof(*replay));
+	for (i = 0; i < INTERFACES_MAX; ++i) {
+		replay->sockets[i][0] = -1;
+		replay->sockets[i][1] = -1;
+	}
+	for (i = 0; i < profile->interfaces; ++i) {
+		if (!profile->interface[i].hid) {
+			continue;
+		}
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, replay->sockets[i]) < 0) {
+			log_errno(ERROR, "Failed to create replay socketpair");
+			replay_free(replay);
+			return false;
+		}
+		/* So a host that stops reading cannot keep the replay from stopping */
+		setsockopt(replay->sockets[i][0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+	replay->capture = capture;
+	replay->fast = fast;
+	return true;
+}
+
+int replay_socket(struct Replay* replay, int interface) {
+	int fd = replay->sockets[interface][1];
+
+	replay->sockets[interface][1] = -1;
+	return fd;
+}
+
+void replay_prime_features(const struct Replay* replay, struct Interface* iface) {
+	const struct CaptureRecord* record;
+	uint64_t offset = 0;
+
+	while ((record = capture_next(replay->capture, &offset))) {
+		if (record->type == CAPTURE_GET_FEATURE && record->interface == iface->index) {
+			feature_cache_store(&iface->feature_cache, record->data, record->length);
+		}
+	}
+}
+
+static bool replay_sleep(struct Replay* replay, uint64_t target) {
+	struct timespec ts;
+	uint64_t now;
+
+	while (!__atomic_load_n(&replay->stop, __ATOMIC_RELAXED)) {
+		now = now_ns();
+		if (now >= target) {
+			return true;
+		}
+		if (target - now > REPLAY_SLEEP_MAX_NS) {
+			now += REPLAY_SLEEP_MAX_NS;
+		} else {
+			now = target;
+		}
+		ts.tv_sec = now / 1000000000ULL;
+		ts.tv_nsec = now % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	return false;
+}
+
+/* Output reports the host sends go nowhere */
+static void replay_discard(struct Replay* replay) {
+	uint8_t buffer[REPORT_SIZE_MAX];
+	int i;
+
+	for (i = 0; i < INTERFACES_MAX; ++i) {
+		if (replay->sockets[i][0] < 0) {
+			continue;
+		}
+		while (recv(replay->sockets[i][0], buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+	}
+}
+
+static bool replay_write(struct Replay* replay, int fd, const struct CaptureRecord* record) {
+	while (write(fd, record->data, record->length) < 0) {
+		if (errno == EAGAIN && !__atomic_load_n(&replay->stop, __ATOMIC_RELAXED)) {
+			replay_discard(replay);
+			continue;
+		}
+		if (errno != EINTR && errno != EAGAIN) {
+			log_errno(ERROR, "Failed to replay report");
+		}
+		return false;
+	}
+	return true;
+}
+
+static void* replay_thread(void* arg) {
+	struct Replay* replay = arg;
+	const struct CaptureRecord* record;
+	uint64_t offset = 0;
+	uint64_t base = 0;
+	uint64_t target;
+	uint64_t now;
+	uint64_t one = 1;
+	int fd;
+
+	while ((record = capture_next(replay->capture, &offset))) {
+		if (record->type != CAPTURE_INPUT || record->interface >= INTERFACES_MAX) {
+			continue;
+		}
+		fd = replay->sockets[record->interface][0];
+		if (fd < 0) {
+			continue;
+		}
+		if (!replay->fast) {
+			/* Played back relative to the first report, not to when the
+			 * capture was opened */
+			if (!base) {
+				base = now_ns() - record->time_ns;
+			}
+			target = base + record->time_ns;
+			if (!replay_sleep(replay, target)) {
+				break;
+			}
+			now = now_ns();
+			replay->late_ns += now - target;
+		}
+		replay_discard(replay);
+		if (!replay_write(replay, fd, record)) {
+			break;
+		}
+		++replay->reports;
+	}
+	if (write(replay->finished.fd, &one, sizeof(one)) < 0) {
+		log_errno(ERROR, "Failed to signal end of replay");
+	}
+	return NULL;
+}
+
+static bool replay_finished(struct LoopSource* source, uint32_t) {
+	struct Replay* replay = source->data;
+
+	log_fmt(INFO, "Replayed %" PRIu64 " reports", replay->reports);
+	if (!replay->fast && replay->reports) {
+		log_fmt(INFO, ", %.1f us late on average", replay->late_ns / 1000.0 / replay->reports);
+	}
+	log_fmt(INFO, "\n");
+	*replay->done = true;
+	return false;
+}
+
+bool replay_start(struct Replay* replay, struct Loop* loop, bool* done) {
+	replay->done = done;
+	replay->finished.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (replay->finished.fd < 0) {
+		log_errno(ERROR, "Failed to create replay eventfd");
+		return false;
+	}
+	replay->finished.events = EPOLLIN;
+	replay->finished.handler = replay_finished;
+	replay->finished.data = replay;
+	if (!loop_add(loop, &replay->finished)) {
+		close(replay->finished.fd);
+		return false;
+	}
+	if (!thread_spawn(&replay->thread, replay_thread, replay)) {
+		loop_del(loop, &replay->finished);
+		close(replay->finished.fd);
+		return false;
+	}
+	replay->loop = loop;
+	return true;
+}
+
+void replay_stop(struct Replay* replay) {
+	if (!replay->loop) {
+		return;
+	}
+	__atomic_store_n(&replay->stop, true, __ATOMIC_RELAXED);
+	pthread_join(replay->thread, NULL);
+	loop_del(replay->loop, &replay->finished);
+	close(replay->finished.fd);
+	replay->loop = NULL;
+}
+
+void replay_free(struct Replay* replay) {
+	int i;
+
+	for (i = 0; i < INTERFACES_MAX; ++i) {
+		if (replay->sockets[i][0] >= 0) {
+			close(replay->sockets[i][0]);
+		}
+		if (replay->sockets[i][1] >= 0) {
+			close(replay->sockets[i][1]);
+		}
+	}
+	replay->capture = NULL;
+}
@@ -0,0 +1,388 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
+#include "control.h"
+#include "forward.h"
+#include "log.h"
+#include "session.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONTROL_COMMAND_MAX 64
+#define METRIC_PREFIX "usbhid_passthru_"
+
+struct ControlMetric {
+	const char* name;
+	const char* type;
+	const char* help;
+	/* Into ControlDirection for per-direction metrics, else ControlRecord */
+	size_t offset;
+	bool direction;
+	/* Kept in nanoseconds, exported in seconds */
+	bool seconds;
+};
+
+#define DIRECTION_METRIC(name, type, help, field, seconds) \
+	{ name, type, help, offsetof(struct ControlDirection, field), true, seconds }
+#define RECORD_METRIC(name, type, help, field) \
+	{ name, type, help, offsetof(struct ControlRecord, field), false, false }
+
+static const struct ControlMetric metrics[] = {
+	DIRECTION_METRIC("reports_total", "counter", "Reports forwarded", reports, false),
+	DIRECTION_METRIC("bytes_total", "counter", "Bytes forwarded", bytes, false),
+	DIRECTION_METRIC("stalls_total", "counter", "Times the receiving side refused a report with EAGAIN", stalls, false),
+	DIRECTION_METRIC("short_writes_total", "counter", "Reports the receiving side only took part of", short_writes, false),
+	DIRECTION_METRIC("stalled_seconds_total", "counter", "Time spent held back by the receiving side", stalled_ns, true),
+	DIRECTION_METRIC("coalesced_total", "counter", "Reports replaced by a newer one while stalled", coalesced, false),
+	DIRECTION_METRIC("dropped_total", "counter", "Reports pushed out of a full queue while stalled", dropped, false),
+	DIRECTION_METRIC("invalid_total", "counter", "Reports whose size does not match the report descriptor", invalid, false),
+	DIRECTION_METRIC("last_report_age_seconds", "gauge", "Time since a report was last forwarded", last_report_age_ns, true),
+	RECORD_METRIC("detached", "gauge", "Whether the device is unplugged", detached),
+	RECORD_METRIC("reattaches_total", "counter", "Times the device came back after being unplugged", reattaches),
+	RECORD_METRIC("feature_transactions_total", "counter", "Feature report transactions", feature_transactions),
+	RECORD_METRIC("feature_failures_total", "counter", "Feature report transactions that failed", feature_failures),
+	RECORD_METRIC("feature_cache_hits_total", "counter", "Feature reports answered from the cache", feature_cache_hits),
+	RECORD_METRIC("output_queued_total", "counter", "Output reports handed to the output worker", output_queued),
+	RECORD_METRIC("output_written_total", "counter", "Output reports the output worker wrote to the device", output_written),
+	RECORD_METRIC("output_failed_total", "counter", "Output reports the device refused", output_failed),
+	RECORD_METRIC("output_discarded_total", "counter", "Output reports thrown away when the device was unplugged", output_discarded),
+	RECORD_METRIC("output_coalesced_total", "counter", "Output reports replaced by a newer one before being written", output_coalesced),
+	RECORD_METRIC("output_queue_depth_max", "gauge", "Most output reports waiting for the device at once", output_depth_max),
+};
+
+static void collect_direction(const struct Direction* dir, struct ControlDirection* out, uint64_t now) {
+	const struct DirectionStats* stats = &dir->stats;
+	uint64_t since = counter_get(&dir->blocked_since);
+	uint64_t last = counter_get(&stats->last_ns);
+
+	out->reports = counter_get(&stats->reports);
+	out->bytes = counter_get(&stats->bytes);
+	out->stalls = counter_get(&stats->stalls);
+	out->short_writes = counter_get(&stats->short_writes);
+	out->stalled_ns = counter_get(&stats->stalled_ns);
+	if (__atomic_load_n(&dir->state, __ATOMIC_RELAXED) == BLOCKED && since < now) {
+		out->stalled_ns += now - since;
+	}
+	out->coalesced = counter_get(&dir->queue.coalesced);
+	out->dropped = counter_get(&dir->queue.dropped);
+	out->invalid = counter_get(&stats->invalid);
+	out->last_report_age_ns = last ? (last < now ? now - last : 0) : UINT64_MAX;
+}
+
+static void collect(const struct Interface* iface, uint32_t session, struct ControlRecord* out, uint64_t now) {
+	const struct OutputStats* output = &iface->dispatch.stats;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+	out->session = session;
+	out->interface = iface->index;
+	out->detached = __atomic_load_n(&iface->detached, __ATOMIC_RELAXED);
+	collect_direction(&iface->input, &out->input, now);
+	collect_direction(&iface->output, &out->output, now);
+	out->feature_transactions = counter_get(&iface->feature_stats.transactions);
+	out->feature_failures = counter_get(&iface->feature_stats.failures);
+	out->feature_cache_hits = counter_get(&iface->feature_stats.cache_hits);
+	out->output_queued = counter_get(&output->queued);
+	out->output_written = counter_get(&output->written);
+	out->output_failed = counter_get(&output->failed);
+	out->output_discarded = counter_get(&output->discarded);
+	out->output_coalesced = counter_get(&iface->dispatch.coalesced);
+	out->output_depth_max = counter_get(&output->depth_max);
+	out->reattaches = counter_get(&iface->reattaches);
+	out->mirrors = iface->nmirrors;
+	for (i = 0; i < iface->nmirrors; ++i) {
+		collect_direction(&iface->mirrors[i].input, &out->mirror[i], now);
+	}
+}
+
+static void print_sample(FILE* out, const struct ControlMetric* metric, const char* gadget, const struct ControlRecord* record,
+                         const char* direction, const char* sink, const void* base) {
+	uint64_t value;
+
+	memcpy(&value, (const uint8_t*) base + metric->offset, sizeof(value));
+	/* Nothing to report before the first report */
+	if (value == UINT64_MAX) {
+		return;
+	}
+	fprintf(out, METRIC_PREFIX "%s{gadget=\"%s\",interface=\"%" PRIu32 "\"", metric->name, gadget, record->interface);
+	if (direction) {
+		fprintf(out, ",direction=\"%s\",sink=\"%s\"", direction, sink);
+	}
+	if (metric->seconds) {
+		fprintf(out, "} %.9f\n", value / 1e9);
+	} else {
+		fprintf(out, "} %" PRIu64 "\n", value);
+	}
+}
+
+static void print_metrics(FILE* out, const struct Control* control, const struct ControlRecord* records, int count) {
+	const struct ControlMetric* metric;
+	const struct Session* session;
+	size_t i;
+	uint32_t k;
+	int j;
+
+	for (i = 0; i < sizeof(metrics) / sizeof(*metrics); ++i) {
+		metric = &metrics[i];
+		fprintf(out, "# HELP " METRIC_PREFIX "%s %s\n", metric->name, metric->help);
+		fprintf(out, "# TYPE " METRIC_PREFIX "%s %s\n", metric->name, metric->type);
+		for (j = 0; j < count; ++j) {
+			session = &control->sessions[records[j].session];
+			if (!metric->direction) {
+				print_sample(out, metric, session->gadget[0].name, &records[j], NULL, NULL, &records[j]);
+				continue;
+			}
+			/* Input goes to the host of each gadget, mirrors included,
+			 * output to the device */
+			print_sample(out, metric, session->gadget[0].name, &records[j], "input", session->gadget[0].name,
+			             &records[j].input);
+			for (k = 0; k < records[j].mirrors; ++k) {
+				print_sample(out, metric, session->gadget[0].name, &records[j], "input", session->gadget[1 + k].name,
+				             &records[j].mirror[k]);
+			}
+			print_sample(out, metric, session->gadget[0].name, &records[j], "output", "device", &records[j].output);
+		}
+	}
+	fprintf(out, "# HELP " METRIC_PREFIX "log_dropped_total Log messages dropped because the log queue was full\n");
+	fprintf(out, "# TYPE " METRIC_PREFIX "log_dropped_total counter\n");
+	fprintf(out, METRIC_PREFIX "log_dropped_total %" PRIu64 "\n", log_dropped());
+}
+
+static void print_stats(FILE* out, const struct ControlRecord* records, int count, uint64_t now) {
+	struct ControlHeader header = {
+		.magic = CONTROL_MAGIC,
+		.version = CONTROL_VERSION,
+		.records = count,
+		.record_size = sizeof(struct ControlRecord),
+		.time_ns = now,
+		.log_dropped = log_dropped(),
+	};
+
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(records, sizeof(*records), count, out);
+}
+
+/* Returns false if no answer could be put together */
+static bool control_answer(const struct Control* control, const char* command, char** buffer, size_t* size) {
+	struct ControlRecord* records;
+	uint64_t now = now_ns();
+	FILE* out;
+	int count = 0;
+	int i, j;
+
+	for (i = 0; i < control->count; ++i) {
+		count += control->sessions[i].count;
+	}
+	records = calloc(count ? count : 1, sizeof(*records));
+	if (!records) {
+		log_errno(ERROR, "Failed to allocate control records");
+		return false;
+	}
+	count = 0;
+	for (i = 0; i < control->count; ++i) {
+		for (j = 0; j < control->sessions[i].count; ++j) {
+			collect(&control->sessions[i].interfaces[j], i, &records[count++], now);
+		}
+	}
+
+	out = open_memstream(buffer, size);
+	if (!out) {
+		log_errno(ERROR, "Failed to open control answer");
+		free(records);
+		return false;
+	}
+	if (!command[0] || strcmp(command, "metrics") == 0) {
+		print_metrics(out, control, records, count);
+	} else if (strcmp(command, "stats") == 0) {
+		print_stats(out, records, count, now);
+	} else {
+		fprintf(out, "Unknown command %s, expected stats or metrics\n", command);
+	}
+	fclose(out);
+	free(records);
+	return true;
+}
+
+static void client_close(struct ControlClient* client) {
+	loop_del(client->control->loop, &client->source);
+	close(client->source.fd);
+	client->source.fd = -1;
+	free(client->buffer);
+	client->buffer = NULL;
+}
+
+/* Sends what is left of the answer, returning false once the client is done */
+static bool client_send(struct ControlClient* client) {
+	ssize_t ret;
+
+	while (client->sent < client->size) {
+		ret = send(client->source.fd, &client->buffer[client->sent], client->size - client->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN;
+		}
+		client->sent += ret;
+	}
+	return false;
+}
+
+static bool client_event(struct LoopSource* source, uint32_t events) {
+	struct ControlClient* client = source->data;
+	char command[CONTROL_COMMAND_MAX];
+	ssize_t size;
+
+	if (events & EPOLLERR) {
+		client_close(client);
+		return true;
+	}
+	if (client->buffer) {
+		if (!client_send(client)) {
+			client_close(client);
+		}
+		return true;
+	}
+
+	size = read(source->fd, command, sizeof(command) - 1);
+	if (size < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			client_close(client);
+		}
+		return true;
+	}
+	while (size > 0 && (command[size - 1] == '\n' || command[size - 1] == '\r' || command[size - 1] == ' ')) {
+		--size;
+	}
+	command[size] = '\0';
+
+	client->sent = 0;
+	if (!control_answer(client->control, command, &client->buffer, &client->size) || !client_send(client)) {
+		client_close(client);
+		return true;
+	}
+	/* The rest goes out as the client reads */
+	if (!loop_mod(client->control->loop, source, EPOLLOUT)) {
+		client_close(client);
+	}
+	return true;
+}
+
+static bool control_event(struct LoopSource* source, uint32_t events) {
+	struct Control* control = source->data;
+	struct ControlClient* client;
+	int fd;
+	int i;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		log_fmt(ERROR, "Control socket failed\n");
+		return false;
+	}
+	while ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		client = NULL;
+		for (i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+			if (control->clients[i].source.fd < 0) {
+				client = &control->clients[i];
+				break;
+			}
+		}
+		if (!client) {
+			log_fmt(DEBUG, "Too many control clients, turning one away\n");
+			close(fd);
+			continue;
+		}
+		client->source.fd = fd;
+		client->source.events = EPOLLIN;
+		if (!loop_add(control->loop, &client->source)) {
+			close(fd);
+			client->source.fd = -1;
+		}
+	}
+	if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+		log_errno(ERROR, "Failed to accept control client");
+	}
+	return true;
+}
+
+bool control_init(struct Control* control, struct Loop* loop, const char* path, const struct Session* sessions, int count) {
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int i;
+
+	memset(control, 0, sizeof(*control));
+	control->source.fd = -1;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_fmt(ERROR, "Control socket path %s is too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	strcpy(control->path, path);
+	control->loop = loop;
+	control->sessions = sessions;
+	control->count = count;
+	for (i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+		control->clients[i].source.fd = -1;
+		control->clients[i].source.handler = client_event;
+		control->clients[i].source.data = &control->clients[i];
+		control->clients[i].control = control;
+	}
+
+	control->source.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->source.fd < 0) {
+		log_errno(ERROR, "Failed to create control socket");
+		return false;
+	}
+	/* Left behind by a run that did not get to clean up */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	if (bind(control->source.fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		log_errno(ERROR, "Failed to bind control socket");
+		goto close_fd;
+	}
+	if (chmod(path, 0660) < 0 || listen(control->source.fd, CONTROL_CLIENTS_MAX) < 0) {
+		log_errno(ERROR, "Failed to listen on control socket");
+		goto unlink_path;
+	}
+	control->source.events = EPOLLIN;
+	control->source.handler = control_event;
+	control->source.data = control;
+	if (!loop_add(loop, &control->source)) {
+		goto unlink_path;
+	}
+	return true;
+
+unlink_path:
+	unlink(path);
+close_fd:
+	close(control->source.fd);
+	control->source.fd = -1;
+	return false;
+}
+
+void control_free(struct Control* control) {
+	int i;
+
+	if (control->source.fd < 0) {
+		return;
+	}
+	for (i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+		if (control->clients[i].source.fd >= 0) {
+			client_close(&control->clients[i]);
+		}
+	}
+	loop_del(control->loop, &control->source);
+	close(control->source.fd);
+	control->source.fd = -1;
+	unlink(control->path);
+}
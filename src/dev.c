@@ -34,11 +34,35 @@ bool find_function(const char* syspath, char* function, size_t function_size) {
 	return !!dent;
 }
 
+static bool is_dev_node(int fd, unsigned nod_major, unsigned nod_minor) {
+	struct stat nod;
+
+	if (fstat(fd, &nod) < 0) {
+		return false;
+	}
+	return S_ISCHR(nod.st_mode) && major(nod.st_rdev) == nod_major && minor(nod.st_rdev) == nod_minor;
+}
+
 int find_dev_node(unsigned nod_major, unsigned nod_minor, const char* prefix) {
 	char nod_path[PATH_MAX];
 	DIR* dir;
 	struct dirent* dent;
 	struct stat nod;
+	int fd;
+
+	/* udev keeps a symlink for every character device here, which saves
+	 * walking all of /dev. Without udev there are none and /dev is walked
+	 * after all. The node is checked again once open, in case the link is
+	 * stale. */
+	snprintf(nod_path, sizeof(nod_path), "/dev/char/%u:%u", nod_major, nod_minor);
+	fd = open(nod_path, O_RDWR, 0666);
+	if (fd >= 0) {
+		if (is_dev_node(fd, nod_major, nod_minor)) {
+			return fd;
+		}
+		close(fd);
+	}
+
 	dir = opendir("/dev");
 	if (!dir) {
 		log_errno(ERROR, "Failed to opendir /dev");
@@ -52,14 +76,15 @@ int find_dev_node(unsigned nod_major, unsigned nod_minor, const char* prefix) {
 		if (strncmp(dent->d_name, prefix, strlen(prefix)) != 0) {
 			continue;
 		}
-		snprintf(nod_path, sizeof(nod_path), "/dev/%s", dent->d_name);
-		if (stat(nod_path, &nod) < 0) {
+		if (fstatat(dirfd(dir), dent->d_name, &nod, 0) < 0) {
 			log_errno(ERROR, "Failed to stat dev node");
+			closedir(dir);
 			return -1;
 		}
 		if (major(nod.st_rdev) == nod_major && minor(nod.st_rdev) == nod_minor) {
+			fd = openat(dirfd(dir), dent->d_name, O_RDWR, 0666);
 			closedir(dir);
-			return open(nod_path, O_RDWR, 0666);
+			return fd;
 		}
 	}
 	closedir(dir);
@@ -181,3 +206,15 @@ int find_hidraw(const char* syspath) {
 	closedir(dir);
 	return find_dev(filename, "hidraw");
 }
+
+/* HID device behind a hidraw node, whatever bus it is on */
+bool find_hid_sysfs_path(const char* hidraw, char* syspath) {
+	char syspath_tmp[PATH_MAX];
+
+	snprintf(syspath_tmp, sizeof(syspath_tmp), "/sys/class/hidraw/%s/device", hidraw);
+	if (realpath(syspath_tmp, syspath) == NULL) {
+		log_errno(ERROR, "Failed to resolve hidraw sysfs path");
+		return false;
+	}
+	return true;
+}
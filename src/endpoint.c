@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "endpoint.h"
+#include "forward.h"
+
+#include <errno.h>
+#include <linux/hidraw.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static ssize_t fd_read(struct Endpoint* ep, void* data, size_t size) {
+	return read(ep->source.fd, data, size);
+}
+
+static ssize_t fd_write(struct Endpoint* ep, const void* data, size_t size) {
+	return write(ep->source.fd, data, size);
+}
+
+static bool unsupported(void) {
+	errno = EOPNOTSUPP;
+	return false;
+}
+
+static bool hidraw_set_feature(struct Endpoint* ep, const uint8_t* data, size_t size) {
+	return ioctl(ep->source.fd, HIDIOCSFEATURE(size), data) >= 0;
+}
+
+static bool hidraw_get_feature(struct Endpoint* ep, uint8_t* data, size_t size) {
+	return ioctl(ep->source.fd, HIDIOCGFEATURE(size), data) >= 0;
+}
+
+static bool hidraw_read_set_report(struct Endpoint*, struct usb_hidg_report*) {
+	return unsupported();
+}
+
+static bool hidraw_write_get_report(struct Endpoint*, const struct usb_hidg_report*) {
+	return unsupported();
+}
+
+const struct EndpointOps hidraw_ops = {
+	.name = "hidraw",
+	.read = fd_read,
+	.write = fd_write,
+	.set_feature = hidraw_set_feature,
+	.get_feature = hidraw_get_feature,
+	.read_set_report = hidraw_read_set_report,
+	.write_get_report = hidraw_write_get_report,
+};
+
+static bool hidg_set_feature(struct Endpoint*, const uint8_t*, size_t) {
+	return unsupported();
+}
+
+static bool hidg_get_feature(struct Endpoint*, uint8_t*, size_t) {
+	return unsupported();
+}
+
+static bool hidg_read_set_report(struct Endpoint* ep, struct usb_hidg_report* report) {
+	return ioctl(ep->source.fd, GADGET_HID_READ_SET_REPORT, report) >= 0;
+}
+
+static bool hidg_write_get_report(struct Endpoint* ep, const struct usb_hidg_report* report) {
+	return ioctl(ep->source.fd, GADGET_HID_WRITE_GET_REPORT, report) >= 0;
+}
+
+const struct EndpointOps hidg_ops = {
+	.name = "hidg",
+	.read = fd_read,
+	.write = fd_write,
+	.set_feature = hidg_set_feature,
+	.get_feature = hidg_get_feature,
+	.read_set_report = hidg_read_set_report,
+	.write_get_report = hidg_write_get_report,
+};
+
+static ssize_t socket_read(struct Endpoint* ep, void* data, size_t size) {
+	return recv(ep->source.fd, data, size, MSG_DONTWAIT);
+}
+
+static ssize_t socket_write(struct Endpoint* ep, const void* data, size_t size) {
+	return send(ep->source.fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static bool socket_set_feature(struct Endpoint*, const uint8_t*, size_t) {
+	return true;
+}
+
+static bool socket_get_feature(struct Endpoint*, uint8_t* data, size_t size) {
+	/* Keep the report number */
+	memset(&data[1], 0, size - 1);
+	return true;
+}
+
+static bool socket_read_set_report(struct Endpoint*, struct usb_hidg_report*) {
+	return unsupported();
+}
+
+static bool socket_write_get_report(struct Endpoint*, const struct usb_hidg_report*) {
+	return true;
+}
+
+const struct EndpointOps socket_ops = {
+	.name = "socket",
+	.read = socket_read,
+	.write = socket_write,
+	.set_feature = socket_set_feature,
+	.get_feature = socket_get_feature,
+	.read_set_report = socket_read_set_report,
+	.write_get_report = socket_write_get_report,
+};
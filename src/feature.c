@@ -0,0 +1,523 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "capture.h"
+#include "feature.h"
+#include "forward.h"
+#include "log.h"
+#include "threads.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void list_push(struct FeatureList* list, struct FeatureRequest* req) {
+	req->next = NULL;
+	if (list->tail) {
+		list->tail->next = req;
+	} else {
+		list->head = req;
+	}
+	list->tail = req;
+}
+
+static struct FeatureRequest* list_pop(struct FeatureList* list) {
+	struct FeatureRequest* req = list->head;
+
+	if (req) {
+		list->head = req->next;
+		if (!list->head) {
+			list->tail = NULL;
+		}
+	}
+	return req;
+}
+
+static struct FeatureEntry* cache_entry(struct FeatureCache* cache, uint8_t id) {
+	const struct ReportTable* reports = cache->reports;
+
+	if (!cache->entries || !reports->index[id]) {
+		return NULL;
+	}
+	return &cache->entries[reports->index[id] - 1];
+}
+
+static const struct FeatureEntry* snapshot_entry(const struct FeatureCache* cache, uint8_t id) {
+	const struct ReportTable* reports = cache->reports;
+
+	if (!cache->snapshot || !reports->index[id]) {
+		return NULL;
+	}
+	return &cache->snapshot[reports->index[id] - 1];
+}
+
+/* Length of a feature report as hidraw transfers it */
+static size_t feature_size(const struct ReportTable* reports, uint8_t id) {
+	/* hidraw always puts the report number first, even if it is implicit */
+	size_t size = report_size(reports, REPORT_FEATURE, id) + !reports->numbered;
+
+	if (size <= 1 || size > sizeof(((struct usb_hidg_report*) NULL)->data)) {
+		return 0;
+	}
+	return size;
+}
+
+/* Runs on the worker thread; the cache is only touched there once running */
+static void feature_transfer(struct FeatureRequest* req) {
+	struct FeatureCache* cache = &req->iface->feature_cache;
+	const struct ReportTable* reports = &req->iface->reports;
+	struct Endpoint* hidraw = &req->iface->hidraw;
+	struct FeatureEntry* entry;
+	uint8_t id;
+	size_t size;
+
+	req->started_ns = now_ns();
+	req->ok = true;
+	req->cached = false;
+	id = reports->numbered ? req->set_report.data[0] : 0;
+	entry = cache_entry(cache, id);
+
+	if (!hidraw->ops->set_feature(hidraw, req->set_report.data, req->set_report.length)) {
+		log_errno(ERROR, "SET ioctl out failed");
+		req->ok = false;
+		/* The device may be in any state now, so re-read it next time */
+		feature_cache_invalidate(cache, id);
+	} else if (entry && entry->policy == FEATURE_WRITE_THROUGH) {
+		if (req->set_report.length == entry->length) {
+			memcpy(entry->data, req->set_report.data, entry->length);
+			entry->valid = true;
+		} else {
+			feature_cache_invalidate(cache, id);
+		}
+	}
+
+	memset(req->get_report.data, 0, sizeof(req->get_report.data));
+	req->get_report.data[0] = req->set_report.data[0];
+	if (entry && entry->valid && entry->policy != FEATURE_FORWARD) {
+		memcpy(req->get_report.data, entry->data, entry->length);
+		req->get_report.length = entry->length;
+		req->cached = true;
+		req->done_ns = now_ns();
+		return;
+	}
+
+	size = feature_size(reports, id);
+	if (!size) {
+		log_fmt(DEBUG, "Feature report %u not in descriptor, assuming %zu bytes\n", id, sizeof(req->get_report.data));
+		size = sizeof(req->get_report.data);
+	}
+	req->get_report.length = size;
+	if (!hidraw->ops->get_feature(hidraw, req->get_report.data, size)) {
+		log_errno(ERROR, "GET ioctl in failed");
+		req->ok = false;
+	} else if (entry && entry->policy != FEATURE_FORWARD) {
+		memcpy(entry->data, req->get_report.data, entry->length);
+		entry->valid = true;
+	}
+	req->done_ns = now_ns();
+}
+
+static void* feature_thread(void* arg) {
+	struct FeatureWorker* worker = arg;
+	struct FeatureRequest* req;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		while (!worker->stop && !worker->pending.head) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		if (worker->stop) {
+			break;
+		}
+		req = list_pop(&worker->pending);
+		worker->current = req;
+		pthread_mutex_unlock(&worker->lock);
+
+		if (req->refresh) {
+			feature_cache_prefetch(&req->iface->feature_cache, &req->iface->hidraw);
+		} else {
+			feature_transfer(req);
+		}
+
+		pthread_mutex_lock(&worker->lock);
+		worker->current = NULL;
+		pthread_cond_broadcast(&worker->idle);
+		list_push(&worker->done, req);
+		if (write(worker->source.fd, &one, sizeof(one)) < 0) {
+			log_errno(ERROR, "Failed to signal feature completion");
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+static void feature_complete(struct FeatureRequest* req) {
+	struct Interface* iface = req->iface;
+	struct Endpoint* hidg = &iface->hidg;
+	struct FeatureStats* stats = &iface->feature_stats;
+	uint64_t latency = now_ns() - req->queued_ns;
+
+	if (req->get_report.data[0] == req->set_report.data[0] && !hidg->ops->write_get_report(hidg, &req->get_report)) {
+		log_errno(ERROR, "GET ioctl out failed");
+		req->ok = false;
+	}
+	if (iface->capture) {
+		capture_record(iface->capture, CAPTURE_SET_FEATURE, iface->index, req->set_report.data,
+		               req->set_report.length, iface->reports.numbered, req->queued_ns);
+		capture_record(iface->capture, CAPTURE_GET_FEATURE, iface->index, req->get_report.data,
+		               req->get_report.length, iface->reports.numbered, req->done_ns);
+	}
+
+	counter_add(&stats->transactions, 1);
+	if (!req->ok) {
+		counter_add(&stats->failures, 1);
+	}
+	if (req->cached) {
+		counter_add(&stats->cache_hits, 1);
+	} else {
+		hist_record(&stats->device, req->done_ns - req->started_ns);
+	}
+	hist_record(&stats->latency, latency);
+	log_fmt(DEBUG, "Feature report %u on interface %d: %" PRIu64 " us queued, "
+	        "%" PRIu64 " us on device, %" PRIu64 " us total%s\n",
+	        req->set_report.data[0], iface->index,
+	        (req->started_ns - req->queued_ns) / 1000,
+	        (req->done_ns - req->started_ns) / 1000,
+	        latency / 1000, req->cached ? ", answered from cache" : "");
+}
+
+static bool feature_event(struct LoopSource* source, uint32_t events) {
+	struct FeatureWorker* worker = source->data;
+	struct FeatureList done;
+	struct FeatureRequest* req;
+	uint64_t count;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		return false;
+	}
+	if (read(source->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		log_errno(ERROR, "Failed to read feature completion");
+		return false;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	done = worker->done;
+	worker->done.head = NULL;
+	worker->done.tail = NULL;
+	pthread_mutex_unlock(&worker->lock);
+
+	while ((req = list_pop(&done))) {
+		if (!req->refresh) {
+			feature_complete(req);
+		}
+		pthread_mutex_lock(&worker->lock);
+		list_push(&worker->free, req);
+		pthread_mutex_unlock(&worker->lock);
+	}
+	return true;
+}
+
+bool feature_init(struct FeatureWorker* worker, struct Loop* loop) {
+	int i;
+
+	memset(worker, 0, sizeof(*worker));
+	worker->loop = loop;
+	for (i = 0; i < FEATURE_REQUESTS_MAX; ++i) {
+		list_push(&worker->free, &worker->requests[i]);
+	}
+
+	worker->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->source.fd < 0) {
+		log_errno(ERROR, "Failed to create feature eventfd");
+		return false;
+	}
+	worker->source.events = EPOLLIN;
+	worker->source.handler = feature_event;
+	worker->source.data = worker;
+	if (!loop_add(loop, &worker->source)) {
+		close(worker->source.fd);
+		return false;
+	}
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	pthread_cond_init(&worker->idle, NULL);
+
+	if (!thread_spawn(&worker->thread, feature_thread, worker)) {
+		loop_del(loop, &worker->source);
+		close(worker->source.fd);
+		return false;
+	}
+	return true;
+}
+
+void feature_free(struct FeatureWorker* worker) {
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = true;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	loop_del(worker->loop, &worker->source);
+	close(worker->source.fd);
+	pthread_cond_destroy(&worker->idle);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+}
+
+static struct FeatureRequest* feature_request(struct FeatureWorker* worker) {
+	struct FeatureRequest* req;
+
+	pthread_mutex_lock(&worker->lock);
+	req = list_pop(&worker->free);
+	pthread_mutex_unlock(&worker->lock);
+	return req;
+}
+
+/* Answers the host right away with an empty report, which it takes as a
+ * failed GET_REPORT. The device and the cache are left to the worker. */
+static void feature_refuse(struct Interface* iface) {
+	struct Endpoint* hidg = &iface->hidg;
+	struct usb_hidg_report set_report;
+	struct usb_hidg_report get_report = {0};
+
+	if (!hidg->ops->read_set_report(hidg, &set_report)) {
+		log_errno(ERROR, "SET ioctl in failed");
+		return;
+	}
+	log_fmt(WARN, "Feature request queue full, failing feature report %u on interface %d\n",
+	        set_report.data[0], iface->index);
+	get_report.data[0] = set_report.data[0];
+	if (!hidg->ops->write_get_report(hidg, &get_report)) {
+		log_errno(ERROR, "GET ioctl out failed");
+	}
+	counter_add(&iface->feature_stats.refused, 1);
+}
+
+void feature_submit(struct FeatureWorker* worker, struct Interface* iface) {
+	struct FeatureRequest* req = feature_request(worker);
+	struct Endpoint* hidg = &iface->hidg;
+
+	if (!req || iface->detached) {
+		if (req) {
+			pthread_mutex_lock(&worker->lock);
+			list_push(&worker->free, req);
+			pthread_mutex_unlock(&worker->lock);
+		}
+		feature_refuse(iface);
+		return;
+	}
+	req->iface = iface;
+	req->refresh = false;
+	req->queued_ns = now_ns();
+	if (!hidg->ops->read_set_report(hidg, &req->set_report)) {
+		log_errno(ERROR, "SET ioctl in failed");
+		pthread_mutex_lock(&worker->lock);
+		list_push(&worker->free, req);
+		pthread_mutex_unlock(&worker->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	list_push(&worker->pending, req);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* The cache is only touched on the worker thread while it runs, so refreshing
+ * it goes through the queue like any transfer */
+void feature_refresh(struct FeatureWorker* worker, struct Interface* iface) {
+	struct FeatureRequest* req = worker ? feature_request(worker) : NULL;
+
+	if (!req) {
+		if (worker) {
+			log_fmt(WARN, "Feature request queue full, not refreshing the feature cache\n");
+		} else {
+			feature_cache_prefetch(&iface->feature_cache, &iface->hidraw);
+		}
+		return;
+	}
+	req->iface = iface;
+	req->refresh = true;
+	req->queued_ns = now_ns();
+
+	pthread_mutex_lock(&worker->lock);
+	list_push(&worker->pending, req);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void feature_cancel(struct FeatureWorker* worker, struct Interface* iface) {
+	struct FeatureList keep = {0};
+	struct FeatureRequest* req;
+	uint64_t one = 1;
+	bool cancelled = false;
+
+	pthread_mutex_lock(&worker->lock);
+	while ((req = list_pop(&worker->pending))) {
+		if (req->iface != iface) {
+			list_push(&keep, req);
+			continue;
+		}
+		/* Completed as failed, so the host still gets its answer */
+		req->ok = false;
+		req->cached = false;
+		req->started_ns = req->done_ns = now_ns();
+		memset(&req->get_report, 0, sizeof(req->get_report));
+		req->get_report.data[0] = req->set_report.data[0];
+		list_push(&worker->done, req);
+		cancelled = true;
+	}
+	worker->pending = keep;
+	while (worker->current && worker->current->iface == iface) {
+		pthread_cond_wait(&worker->idle, &worker->lock);
+	}
+	if (cancelled && write(worker->source.fd, &one, sizeof(one)) < 0) {
+		log_errno(ERROR, "Failed to signal feature completion");
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Only the primary host's feature reports reach the device. A mirror's host is
+ * answered on the loop thread from the snapshot of what the cache read at
+ * startup, or with zeroes if the report is not static. */
+void feature_answer_mirror(struct Mirror* mirror) {
+	struct Interface* iface = mirror->hidg.iface;
+	struct Endpoint* hidg = &mirror->hidg;
+	struct usb_hidg_report set_report;
+	struct usb_hidg_report get_report = {0};
+	const struct FeatureEntry* entry;
+	uint8_t id;
+
+	if (!hidg->ops->read_set_report(hidg, &set_report)) {
+		log_errno(ERROR, "SET ioctl in failed");
+		return;
+	}
+	id = iface->reports.numbered ? set_report.data[0] : 0;
+	entry = snapshot_entry(&iface->feature_cache, id);
+	get_report.data[0] = set_report.data[0];
+	get_report.length = feature_size(&iface->reports, id);
+	if (!get_report.length) {
+		get_report.length = sizeof(get_report.data);
+	}
+	if (entry && entry->valid && entry->policy == FEATURE_STATIC) {
+		memcpy(get_report.data, entry->data, entry->length);
+		get_report.length = entry->length;
+	}
+	if (!hidg->ops->write_get_report(hidg, &get_report)) {
+		log_errno(ERROR, "GET ioctl out failed");
+	}
+	counter_add(&mirror->features, 1);
+}
+
+bool feature_cache_init(struct FeatureCache* cache, const struct ReportTable* reports, const uint8_t* policies, enum FeaturePolicy fallback) {
+	int i;
+
+	cache->reports = reports;
+	cache->entries = NULL;
+	if (!reports->count) {
+		return true;
+	}
+	cache->entries = calloc(reports->count, sizeof(*cache->entries));
+	if (!cache->entries) {
+		log_errno(ERROR, "Failed to allocate feature cache");
+		return false;
+	}
+	for (i = 0; i < reports->count; ++i) {
+		struct FeatureEntry* entry = &cache->entries[i];
+		uint8_t id = reports->reports[i].id;
+
+		entry->policy = policies[id] == FEATURE_DEFAULT ? fallback : policies[id];
+		if (entry->policy == FEATURE_DEFAULT) {
+			entry->policy = FEATURE_FORWARD;
+		}
+		entry->length = feature_size(reports, id);
+		if (!entry->length) {
+			/* Not a feature report, or too large to answer through hidg */
+			entry->policy = FEATURE_FORWARD;
+		}
+	}
+	return true;
+}
+
+void feature_cache_free(struct FeatureCache* cache) {
+	free(cache->entries);
+	free(cache->snapshot);
+	cache->entries = NULL;
+	cache->snapshot = NULL;
+}
+
+bool feature_cache_snapshot(struct FeatureCache* cache) {
+	size_t size = cache->reports->count * sizeof(*cache->entries);
+
+	if (!cache->entries || cache->snapshot) {
+		return true;
+	}
+	cache->snapshot = malloc(size);
+	if (!cache->snapshot) {
+		return false;
+	}
+	memcpy(cache->snapshot, cache->entries, size);
+	return true;
+}
+
+void feature_cache_prefetch(struct FeatureCache* cache, struct Endpoint* hidraw) {
+	const struct ReportTable* reports = cache->reports;
+	int i;
+
+	for (i = 0; cache->entries && i < reports->count; ++i) {
+		struct FeatureEntry* entry = &cache->entries[i];
+
+		if (entry->policy == FEATURE_FORWARD) {
+			continue;
+		}
+		entry->valid = false;
+		memset(entry->data, 0, sizeof(entry->data));
+		entry->data[0] = reports->reports[i].id;
+		if (!hidraw->ops->get_feature(hidraw, entry->data, entry->length)) {
+			log_errno(WARN, "Failed to prefetch feature report");
+			continue;
+		}
+		entry->valid = true;
+		log_fmt(DEBUG, "Prefetched feature report %u (%u bytes)\n", reports->reports[i].id, entry->length);
+	}
+}
+
+void feature_cache_invalidate(struct FeatureCache* cache, uint8_t id) {
+	struct FeatureEntry* entry = cache_entry(cache, id);
+
+	if (entry) {
+		entry->valid = false;
+	}
+}
+
+void feature_cache_store(struct FeatureCache* cache, const uint8_t* data, size_t size) {
+	struct FeatureEntry* entry;
+
+	if (!size) {
+		return;
+	}
+	entry = cache_entry(cache, cache->reports->numbered ? data[0] : 0);
+	if (!entry || entry->policy == FEATURE_FORWARD || size != entry->length) {
+		return;
+	}
+	memcpy(entry->data, data, size);
+	entry->valid = true;
+}
+
+bool feature_policy_parse(const char* name, enum FeaturePolicy* policy) {
+	if (strcmp(name, "forward") == 0) {
+		*policy = FEATURE_FORWARD;
+	} else if (strcmp(name, "static") == 0) {
+		*policy = FEATURE_STATIC;
+	} else if (strcmp(name, "write-through") == 0) {
+		*policy = FEATURE_WRITE_THROUGH;
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,608 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "capture.h"
+#include "forward.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Output reports handed to the output worker rather than written here */
+static bool direction_dispatched(const struct Direction* dir) {
+	return dir == &dir->source->iface->output && dir->source->iface->dispatch.worker;
+}
+
+static uint32_t endpoint_events(const struct Endpoint* ep) {
+	uint32_t events = EPOLLET | ep->extra_events;
+	/* Input keeps being read while the host is stalled, so the newest
+	 * report per ID waits in our queue rather than in the device's ring */
+	if (ep->reader->state == FLOWING || ep->reader == &ep->iface->input) {
+		events |= EPOLLIN;
+	}
+	/* Room in the output queue is signalled by the worker instead */
+	if (ep->writer->state == BLOCKED && !direction_dispatched(ep->writer)) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
+static bool endpoint_rearm(struct Endpoint* ep) {
+	/* A detached device is not in the loop */
+	if (ep->source.fd < 0) {
+		return true;
+	}
+	return loop_mod(ep->iface->loop, &ep->source, endpoint_events(ep));
+}
+
+static bool direction_rearm(struct Direction* dir) {
+	return endpoint_rearm(dir->source) && endpoint_rearm(dir->sink);
+}
+
+static bool direction_block(struct Direction* dir) {
+	dir->state = BLOCKED;
+	counter_set(&dir->blocked_since, now_ns());
+	counter_add(&dir->stats.stalls, 1);
+	return direction_rearm(dir);
+}
+
+static bool direction_unblock(struct Direction* dir) {
+	uint64_t stalled = now_ns() - dir->blocked_since;
+
+	dir->state = FLOWING;
+	counter_add(&dir->stats.stalled_ns, stalled);
+	if (stalled > dir->stats.stalled_max_ns) {
+		counter_set(&dir->stats.stalled_max_ns, stalled);
+	}
+	return direction_rearm(dir);
+}
+
+/* Returns the number of bytes written, 0 if the sink is full, or -1 on error.
+ * ready_ns is when the loop learned the report could be read. */
+static ssize_t direction_write(struct Direction* dir, const uint8_t* data, size_t size, uint64_t ready_ns) {
+	size_t loc = 0;
+	ssize_t ret;
+
+	while (loc < size) {
+		if (direction_dispatched(dir)) {
+			ret = output_push(&dir->source->iface->dispatch, &data[loc], size - loc, ready_ns);
+		} else {
+			ret = dir->sink->ops->write(dir->sink, &data[loc], size - loc);
+		}
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				if (loc > 0) {
+					log_fmt(WARN, "Truncated %s report on interface %d\n", dir->name, dir->source->iface->index);
+					counter_add(&dir->stats.short_writes, 1);
+				}
+				break;
+			}
+			log_errno(ERROR, "Failed to write packet");
+			return -1;
+		}
+		loc += ret;
+	}
+	if (loc > 0) {
+		uint64_t now = now_ns();
+
+		counter_add(&dir->stats.reports, 1);
+		counter_add(&dir->stats.bytes, loc);
+		counter_set(&dir->stats.last_ns, now);
+		hist_record(&dir->latency.total, now - ready_ns);
+	}
+	return loc;
+}
+
+static bool direction_flush(struct Direction* dir) {
+	const uint8_t* data;
+	size_t size;
+	uint64_t ready_ns;
+	ssize_t ret;
+
+	while ((data = queue_peek(&dir->queue, &size, &ready_ns))) {
+		ret = direction_write(dir, data, size, ready_ns);
+		if (ret < 0) {
+			return false;
+		}
+		if (ret == 0) {
+			return direction_block(dir);
+		}
+		queue_pop(&dir->queue);
+	}
+	return true;
+}
+
+/* Copies an input report to every mirror, queueing it for those that are
+ * stalled */
+static bool mirror_push(struct Interface* iface, const uint8_t* data, size_t size, uint64_t ready_ns) {
+	struct Direction* dir;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iface->nmirrors; ++i) {
+		dir = &iface->mirrors[i].input;
+		if (dir->state == FLOWING) {
+			ret = direction_write(dir, data, size, ready_ns);
+			if (ret < 0) {
+				return false;
+			}
+			if (ret > 0) {
+				continue;
+			}
+			if (!direction_block(dir)) {
+				return false;
+			}
+		}
+		if (!queue_push(&dir->queue, data, size, ready_ns)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Returns the report size, 0 once the source is drained, or -1 on error */
+static ssize_t direction_read(struct Direction* dir) {
+	struct Interface* iface = dir->source->iface;
+	ssize_t size;
+
+	while (dir->source->readable) {
+		size = dir->source->ops->read(dir->source, dir->buffer, sizeof(dir->buffer));
+		if (size > 0) {
+			hist_record(&dir->latency.read, now_ns() - iface->loop->woken_ns);
+			if (dir == &iface->input) {
+				loop_report(iface->loop);
+			}
+			if (!report_valid(&iface->reports, dir->type, dir->buffer, size)) {
+				counter_add(&dir->stats.invalid, 1);
+			}
+			if (iface->capture) {
+				capture_record(iface->capture, dir->type == REPORT_INPUT ? CAPTURE_INPUT : CAPTURE_OUTPUT,
+				               iface->index, dir->buffer, size, iface->reports.numbered, iface->loop->woken_ns);
+			}
+			if (dir == &iface->input && !mirror_push(iface, dir->buffer, size, iface->loop->woken_ns)) {
+				return -1;
+			}
+			return size;
+		}
+		/* A closed peer reads as empty for ever, so it counts as drained
+		 * too rather than being pumped again */
+		if (size == 0 || errno == EAGAIN) {
+			dir->source->readable = false;
+			return 0;
+		}
+		if (errno != EINTR) {
+			log_errno(ERROR, "Failed to read packet");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool direction_pump(struct Direction* dir) {
+	uint64_t ready_ns = dir->source->iface->loop->woken_ns;
+	ssize_t size = 0;
+	ssize_t ret;
+
+	if (dir->state == BLOCKED) {
+		if (dir != &dir->source->iface->input) {
+			return true;
+		}
+		/* The hidraw ring drops the newest reports once it fills up, so
+		 * drain it into the queue, where the stalled host is sent the
+		 * latest report per ID once it catches up. Mirrors get theirs
+		 * along the way. */
+		while ((size = direction_read(dir)) > 0) {
+			if (!queue_push(&dir->queue, dir->buffer, size, ready_ns)) {
+				return false;
+			}
+		}
+		return size >= 0;
+	}
+	if (!queue_empty(&dir->queue)) {
+		/* Coming out of a stall: collapse the backlog before sending it.
+		 * The output worker coalesces on its side, and reading ahead of it
+		 * would only push reports out of the FIFO. */
+		while (!direction_dispatched(dir) && (size = direction_read(dir)) > 0) {
+			if (!queue_push(&dir->queue, dir->buffer, size, ready_ns)) {
+				return false;
+			}
+		}
+		if (size < 0 || !direction_flush(dir)) {
+			return false;
+		}
+	}
+	while (dir->state == FLOWING && (size = direction_read(dir)) > 0) {
+		ret = direction_write(dir, dir->buffer, size, ready_ns);
+		if (ret < 0) {
+			return false;
+		}
+		if (ret == 0) {
+			if (!queue_push(&dir->queue, dir->buffer, size, ready_ns)) {
+				return false;
+			}
+			return direction_block(dir);
+		}
+	}
+	return size >= 0;
+}
+
+static bool interface_detach(struct Interface* iface) {
+	struct Direction* output = &iface->output;
+
+	log_fmt(WARN, "Interface %d lost its device, waiting for it to return\n", iface->index);
+	if (iface->dispatch.worker) {
+		output_discard(&iface->dispatch);
+	}
+	/* The feature worker must be done with the fd before its number can be
+	 * handed to another device */
+	if (iface->feature_worker) {
+		feature_cancel(iface->feature_worker, iface);
+	}
+	loop_del(iface->loop, &iface->hidraw.source);
+	close(iface->hidraw.source.fd);
+	iface->hidraw.source.fd = -1;
+	iface->hidraw.readable = false;
+	iface->detached = true;
+	iface->detached_ns = now_ns();
+
+	/* Stop reading from the host until there is a device to write to */
+	if (output->state == FLOWING) {
+		output->state = BLOCKED;
+		counter_set(&output->blocked_since, iface->detached_ns);
+		counter_add(&output->stats.stalls, 1);
+		return endpoint_rearm(output->source);
+	}
+	return true;
+}
+
+static bool endpoint_event(struct LoopSource* source, uint32_t events) {
+	struct Endpoint* ep = source->data;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		if (ep == &ep->iface->hidraw && ep->iface->reattach) {
+			return interface_detach(ep->iface);
+		}
+		return false;
+	}
+	if (events & EPOLLPRI) {
+		feature_submit(ep->iface->feature_worker, ep->iface);
+	}
+	if (events & EPOLLOUT && ep->writer->state == BLOCKED) {
+		if (!direction_unblock(ep->writer) || !direction_pump(ep->writer)) {
+			return false;
+		}
+	}
+	if (events & EPOLLIN) {
+		ep->readable = true;
+		if (!direction_pump(ep->reader)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* The worker made room in a full output queue */
+static bool dispatch_event(struct LoopSource* source, uint32_t events) {
+	struct Interface* iface = ((struct OutputQueue*) source->data)->iface;
+	uint64_t count;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		return false;
+	}
+	if (read(source->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		log_errno(ERROR, "Failed to read output queue space");
+		return false;
+	}
+	if (iface->output.state == BLOCKED && !iface->detached) {
+		return direction_unblock(&iface->output) && direction_pump(&iface->output);
+	}
+	return true;
+}
+
+static bool mirror_event(struct LoopSource* source, uint32_t events) {
+	struct Mirror* mirror = source->data;
+	struct Endpoint* hidg = &mirror->hidg;
+	ssize_t size;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		return false;
+	}
+	if (events & EPOLLPRI) {
+		feature_answer_mirror(mirror);
+	}
+	if (events & EPOLLOUT && mirror->input.state == BLOCKED) {
+		if (!direction_unblock(&mirror->input) || !direction_flush(&mirror->input)) {
+			return false;
+		}
+	}
+	if (events & EPOLLIN) {
+		/* Output reports from a mirror's host go nowhere */
+		while ((size = hidg->ops->read(hidg, mirror->output.buffer, sizeof(mirror->output.buffer))) != 0) {
+			if (size > 0) {
+				counter_add(&mirror->discarded, 1);
+			} else if (errno == EAGAIN) {
+				break;
+			} else if (errno != EINTR) {
+				log_errno(ERROR, "Failed to read packet");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void endpoint_init(struct Endpoint* ep, struct Interface* iface, int fd, const struct EndpointOps* ops, struct Direction* reader, struct Direction* writer) {
+	ep->ops = ops;
+	ep->iface = iface;
+	ep->reader = reader;
+	ep->writer = writer;
+	ep->source.fd = fd;
+	ep->source.handler = endpoint_event;
+	ep->source.data = ep;
+}
+
+static void direction_init(struct Direction* dir, const char* name, enum ReportType type, struct Endpoint* source, struct Endpoint* sink) {
+	dir->name = name;
+	dir->type = type;
+	dir->source = source;
+	dir->sink = sink;
+	dir->state = FLOWING;
+}
+
+bool forward_init(struct Interface* iface, int index, int hidraw, int hidg, const struct ReportTable* reports) {
+	int i;
+
+	memset(iface, 0, sizeof(*iface));
+	iface->index = index;
+
+	endpoint_init(&iface->hidraw, iface, hidraw, &hidraw_ops, &iface->input, &iface->output);
+	endpoint_init(&iface->hidg, iface, hidg, &hidg_ops, &iface->output, &iface->input);
+	iface->hidg.extra_events = EPOLLPRI;
+	iface->hidraw.source.events = endpoint_events(&iface->hidraw);
+	iface->hidg.source.events = endpoint_events(&iface->hidg);
+
+	direction_init(&iface->input, "input", REPORT_INPUT, &iface->hidraw, &iface->hidg);
+	direction_init(&iface->output, "output", REPORT_OUTPUT, &iface->hidg, &iface->hidraw);
+	iface->reports = *reports;
+
+	/* Input reports carry state and only the latest matters, while output
+	 * reports are commands that must all reach the device */
+	queue_init(&iface->input.queue, reports->numbered, REPORT_LATEST);
+	queue_init(&iface->output.queue, reports->numbered, REPORT_FIFO);
+	for (i = 0; i < reports->count; ++i) {
+		uint8_t id = reports->reports[i].id;
+		size_t size = report_size(reports, REPORT_INPUT, id);
+		if (size && !queue_reserve(&iface->input.queue, id, size)) {
+			return false;
+		}
+		size = report_size(reports, REPORT_OUTPUT, id);
+		if (size && !queue_reserve(&iface->output.queue, id, size)) {
+			return false;
+		}
+	}
+
+	/* No device yet: wait for forward_reattach as if it had been unplugged */
+	if (hidraw < 0) {
+		iface->detached = true;
+		iface->detached_ns = now_ns();
+		iface->output.state = BLOCKED;
+		iface->output.blocked_since = iface->detached_ns;
+		iface->hidg.source.events = endpoint_events(&iface->hidg);
+	}
+	return true;
+}
+
+bool forward_init_mirrors(struct Interface* iface, const int* hidg, int count) {
+	struct Mirror* mirror;
+	size_t size;
+	int i;
+
+	iface->mirrors = calloc(count, sizeof(*iface->mirrors));
+	if (!iface->mirrors || !feature_cache_snapshot(&iface->feature_cache)) {
+		log_errno(ERROR, "Failed to allocate mirrors");
+		for (i = 0; i < count; ++i) {
+			close(hidg[i]);
+		}
+		return false;
+	}
+	iface->nmirrors = count;
+	for (i = 0; i < count; ++i) {
+		mirror = &iface->mirrors[i];
+		snprintf(mirror->name, sizeof(mirror->name), "mirror %d", i + 1);
+		endpoint_init(&mirror->hidg, iface, hidg[i], &hidg_ops, &mirror->output, &mirror->input);
+		mirror->hidg.extra_events = EPOLLPRI;
+		mirror->hidg.source.handler = mirror_event;
+		mirror->hidg.source.data = mirror;
+		direction_init(&mirror->input, mirror->name, REPORT_INPUT, &iface->hidraw, &mirror->hidg);
+		direction_init(&mirror->output, "discarded", REPORT_OUTPUT, &mirror->hidg, NULL);
+		mirror->hidg.source.events = endpoint_events(&mirror->hidg);
+	}
+	iface->hidraw.source.events = endpoint_events(&iface->hidraw);
+
+	/* Queued the same way as for the primary host */
+	for (i = 0; i < count; ++i) {
+		struct ReportQueue* queue = &iface->mirrors[i].input.queue;
+		int id;
+
+		queue_init(queue, iface->reports.numbered, REPORT_LATEST);
+		for (id = 0; id < REPORT_IDS; ++id) {
+			size = report_size(&iface->reports, REPORT_INPUT, id);
+			if (size && !queue_reserve(queue, id, size)) {
+				return false;
+			}
+			if (iface->input.queue.modes[id] != REPORT_LATEST && !queue_set_mode(queue, id, iface->input.queue.modes[id])) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool freeze_queue(struct ReportQueue* queue) {
+	/* Without report IDs every report goes to the one slot, whatever its
+	 * size, which is also all there is when the descriptor did not parse */
+	if (!queue->numbered && !queue_reserve(queue, 0, REPORT_SIZE_MAX)) {
+		return false;
+	}
+	queue_freeze(queue);
+	return true;
+}
+
+bool forward_freeze(struct Interface* iface) {
+	int i;
+
+	if (!freeze_queue(&iface->input.queue) || !freeze_queue(&iface->output.queue)) {
+		return false;
+	}
+	for (i = 0; i < iface->nmirrors; ++i) {
+		if (!freeze_queue(&iface->mirrors[i].input.queue)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool forward_dispatch_output(struct Interface* iface, struct OutputWorker* worker) {
+	if (!output_queue_init(&iface->dispatch, worker, iface, &iface->output.queue)) {
+		return false;
+	}
+	iface->dispatch.source.handler = dispatch_event;
+	iface->hidraw.source.events = endpoint_events(&iface->hidraw);
+	return true;
+}
+
+bool forward_attach(struct Interface* iface, struct Loop* loop, struct FeatureWorker* feature_worker) {
+	int i;
+
+	iface->loop = loop;
+	iface->feature_worker = feature_worker;
+	if (iface->hidraw.source.fd >= 0 && !loop_add(loop, &iface->hidraw.source)) {
+		return false;
+	}
+	if (!loop_add(loop, &iface->hidg.source)) {
+		goto del_hidraw;
+	}
+	if (iface->dispatch.worker && !loop_add(loop, &iface->dispatch.source)) {
+		goto del_hidg;
+	}
+	for (i = 0; i < iface->nmirrors; ++i) {
+		if (!loop_add(loop, &iface->mirrors[i].hidg.source)) {
+			goto del_mirrors;
+		}
+	}
+	return true;
+
+del_mirrors:
+	while (i--) {
+		loop_del(loop, &iface->mirrors[i].hidg.source);
+	}
+	if (iface->dispatch.worker) {
+		loop_del(loop, &iface->dispatch.source);
+	}
+del_hidg:
+	loop_del(loop, &iface->hidg.source);
+del_hidraw:
+	if (iface->hidraw.source.fd >= 0) {
+		loop_del(loop, &iface->hidraw.source);
+	}
+	return false;
+}
+
+bool forward_reattach(struct Interface* iface, int hidraw) {
+	struct Endpoint* ep = &iface->hidraw;
+
+	ep->source.fd = hidraw;
+	ep->source.events = endpoint_events(ep);
+	if (!loop_add(iface->loop, &ep->source)) {
+		ep->source.fd = -1;
+		return false;
+	}
+	iface->detached = false;
+	counter_add(&iface->reattaches, 1);
+	log_fmt(INFO, "Interface %d reattached after %.1f ms\n", iface->index, (now_ns() - iface->detached_ns) / 1e6);
+
+	/* The device may not be in the state the cache remembers */
+	feature_refresh(iface->feature_worker, iface);
+	return direction_unblock(&iface->output) && direction_pump(&iface->output);
+}
+
+void forward_close(struct Interface* iface) {
+	int i;
+
+	if (iface->hidg.source.fd >= 0) {
+		close(iface->hidg.source.fd);
+		iface->hidg.source.fd = -1;
+	}
+	if (iface->hidraw.source.fd >= 0) {
+		close(iface->hidraw.source.fd);
+		iface->hidraw.source.fd = -1;
+	}
+	for (i = 0; i < iface->nmirrors; ++i) {
+		close(iface->mirrors[i].hidg.source.fd);
+		queue_free(&iface->mirrors[i].input.queue);
+	}
+	free(iface->mirrors);
+	iface->mirrors = NULL;
+	iface->nmirrors = 0;
+	queue_free(&iface->input.queue);
+	queue_free(&iface->output.queue);
+	output_queue_free(&iface->dispatch);
+	feature_cache_free(&iface->feature_cache);
+}
+
+static void direction_log_stats(const struct Interface* iface, const struct Direction* dir) {
+	const struct DirectionStats* stats = &dir->stats;
+	uint64_t stalled_ns = stats->stalled_ns;
+
+	if (dir->state == BLOCKED) {
+		stalled_ns += now_ns() - dir->blocked_since;
+	}
+	log_fmt(INFO, "Interface %d %s: %" PRIu64 " reports, %" PRIu64 " bytes, "
+	        "%" PRIu64 " stalls, %" PRIu64 " us stalled (max %" PRIu64 " us), "
+	        "%" PRIu64 " coalesced, %" PRIu64 " dropped, %" PRIu64 " invalid\n",
+	        iface->index, dir->name, stats->reports, stats->bytes,
+	        stats->stalls, stalled_ns / 1000, stats->stalled_max_ns / 1000,
+	        dir->queue.coalesced, dir->queue.dropped, stats->invalid);
+	hist_log(&dir->latency.read, "read");
+	hist_log(&dir->latency.total, "total");
+}
+
+void forward_log_stats(const struct Interface* iface) {
+	const struct FeatureStats* features = &iface->feature_stats;
+	const struct Mirror* mirror;
+	int i;
+
+	direction_log_stats(iface, &iface->input);
+	direction_log_stats(iface, &iface->output);
+	output_log_stats(&iface->dispatch);
+	for (i = 0; i < iface->nmirrors; ++i) {
+		mirror = &iface->mirrors[i];
+		direction_log_stats(iface, &mirror->input);
+		if (mirror->discarded || mirror->features) {
+			log_fmt(INFO, "Interface %d %s: %" PRIu64 " output reports discarded, "
+			        "%" PRIu64 " feature reports answered locally\n",
+			        iface->index, mirror->name, mirror->discarded, mirror->features);
+		}
+	}
+	if (iface->reattaches) {
+		log_fmt(INFO, "Interface %d reattached %" PRIu64 " times\n", iface->index, iface->reattaches);
+	}
+	if (features->transactions) {
+		log_fmt(INFO, "Interface %d features: %" PRIu64 " transactions, %" PRIu64 " failed, "
+		        "%" PRIu64 " from cache\n",
+		        iface->index, features->transactions, features->failures, features->cache_hits);
+		hist_log(&features->latency, "total");
+		hist_log(&features->device, "device");
+	}
+	if (features->refused) {
+		log_fmt(INFO, "Interface %d features: %" PRIu64 " refused with the queue full\n",
+		        iface->index, features->refused);
+	}
+}
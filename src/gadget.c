@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "gadget.h"
+#include "log.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Report length for an interface whose descriptor gives no sizes */
+#define REPORT_LENGTH_DEFAULT 64
+
+__attribute__((format(printf, 3, 4)))
+static bool write_attr(int dirfd, const char* name, const char* fmt, ...) {
+	va_list args;
+	int fd;
+	int ret;
+
+	fd = openat(dirfd, name, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open property output");
+		return false;
+	}
+	va_start(args, fmt);
+	ret = vdprintf(fd, fmt, args);
+	va_end(args);
+	close(fd);
+	if (ret < 0) {
+		log_errno(ERROR, "Failed to write property");
+		return false;
+	}
+	return true;
+}
+
+/* Empty strings are left out rather than written */
+static bool write_string(int dirfd, const char* name, const char* value) {
+	if (!value[0]) {
+		return true;
+	}
+	return write_attr(dirfd, name, "%s\n", value);
+}
+
+/* Reads a whole attribute, without the trailing newline. Returns the length,
+ * or -1 if it could not be read. */
+static ssize_t read_attr(int dirfd, const char* name, char* out, size_t size) {
+	ssize_t len;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	len = read(fd, out, size - 1);
+	close(fd);
+	if (len < 0) {
+		return -1;
+	}
+	if (len && out[len - 1] == '\n') {
+		--len;
+	}
+	out[len] = '\0';
+	return len;
+}
+
+static bool attr_is(int dirfd, const char* name, unsigned long value) {
+	char buf[32];
+	char* end;
+
+	if (read_attr(dirfd, name, buf, sizeof(buf)) <= 0) {
+		return false;
+	}
+	return strtoul(buf, &end, 0) == value && !*end;
+}
+
+static bool string_is(int dirfd, const char* name, const char* value) {
+	char buf[PROFILE_STRING_MAX + 1];
+
+	if (read_attr(dirfd, name, buf, sizeof(buf)) < 0) {
+		return !value[0];
+	}
+	return strcmp(buf, value) == 0;
+}
+
+static int open_dir(int dirfd, const char* name, bool create) {
+	int fd;
+
+	if (create && mkdirat(dirfd, name, 0755) < 0 && errno != EEXIST) {
+		log_errno(ERROR, "Failed to make configfs directory");
+		return -1;
+	}
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open configfs directory");
+	}
+	return fd;
+}
+
+static bool write_descriptor(int function, const struct InterfaceProfile* iface) {
+	int fd;
+
+	fd = openat(function, "report_desc", O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open report descriptor output file");
+		return false;
+	}
+	if (write(fd, iface->descriptor, iface->descriptor_size) != iface->descriptor_size) {
+		log_errno(ERROR, "Failed to write report descriptor file");
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+/* The endpoint has to fit the largest report in either direction. Returns 0
+ * if the descriptor gives no sizes. */
+static size_t parse_reports(const struct InterfaceProfile* iface, struct ReportTable* reports) {
+	size_t report_length;
+
+	if (!report_parse(reports, iface->descriptor, iface->descriptor_size)) {
+		memset(reports, 0, sizeof(*reports));
+		return 0;
+	}
+	report_length = report_max_size(reports, REPORT_INPUT);
+	if (report_max_size(reports, REPORT_OUTPUT) > report_length) {
+		report_length = report_max_size(reports, REPORT_OUTPUT);
+	}
+	return report_length;
+}
+
+static size_t size_reports(int fn, const struct InterfaceProfile* iface, struct ReportTable* reports) {
+	size_t report_length = parse_reports(iface, reports);
+
+	if (!report_length) {
+		log_fmt(WARN, "Could not size reports for interface %d, assuming %d bytes\n", fn, REPORT_LENGTH_DEFAULT);
+		report_length = REPORT_LENGTH_DEFAULT;
+	}
+	log_fmt(DEBUG, "Interface %d: %u reports, report length %zu\n", fn, reports->count, report_length);
+	return report_length;
+}
+
+static bool create_function(int gadget, int config, const char* configfs, int fn, const struct InterfaceProfile* iface, struct ReportTable* reports) {
+	char name[32];
+	char target[PATH_MAX];
+	size_t report_length;
+	int function;
+	bool ok = false;
+
+	snprintf(name, sizeof(name), "functions/hid.usb%d", fn);
+	function = open_dir(gadget, name, true);
+	if (function < 0) {
+		return false;
+	}
+	if (!write_attr(function, "protocol", "%u\n", iface->protocol) ||
+	    !write_attr(function, "subclass", "%u\n", iface->subclass) ||
+	    !write_descriptor(function, iface)) {
+		goto done;
+	}
+
+	report_length = size_reports(fn, iface, reports);
+	if (!write_attr(function, "report_length", "%zu\n", report_length)) {
+		goto done;
+	}
+
+	snprintf(target, sizeof(target), "%s/%s", configfs, name);
+	snprintf(name, sizeof(name), "hid.usb%d", fn);
+	if (symlinkat(target, config, name) < 0) {
+		log_errno(ERROR, "Failed to symlink interface config");
+		goto done;
+	}
+	ok = true;
+
+done:
+	close(function);
+	return ok;
+}
+
+bool gadget_create(const char* configfs, const struct DeviceProfile* profile, struct ReportTable* reports) {
+	int gadget = -1;
+	int strings = -1;
+	int config = -1;
+	int config_strings = -1;
+	bool ok = false;
+	int i;
+
+	if (mkdir(configfs, 0755) == -1 && errno != EEXIST) {
+		log_errno(ERROR, "Failed to make configfs directory");
+		return false;
+	}
+	gadget = open_dir(AT_FDCWD, configfs, false);
+	if (gadget < 0) {
+		return false;
+	}
+	strings = open_dir(gadget, "strings/0x409", true);
+	config = open_dir(gadget, "configs/c.1", true);
+	if (strings < 0 || config < 0) {
+		goto done;
+	}
+	config_strings = open_dir(config, "strings/0x409", true);
+	if (config_strings < 0) {
+		goto done;
+	}
+
+	if (!write_attr(gadget, "bDeviceProtocol", "0x%02x\n", profile->device_protocol) ||
+	    !write_attr(gadget, "bDeviceSubClass", "0x%02x\n", profile->device_subclass) ||
+	    !write_attr(gadget, "idVendor", "0x%04x\n", profile->vendor_id) ||
+	    !write_attr(gadget, "idProduct", "0x%04x\n", profile->product_id) ||
+	    !write_attr(gadget, "bcdDevice", "0x%04x\n", profile->bcd_device) ||
+	    !write_attr(gadget, "bcdUSB", "0x%04x\n", profile->bcd_usb) ||
+	    !write_string(strings, "manufacturer", profile->manufacturer) ||
+	    !write_string(strings, "product", profile->product) ||
+	    !write_string(strings, "serialnumber", profile->serial) ||
+	    !write_string(config_strings, "configuration", profile->configuration) ||
+	    !write_attr(config, "MaxPower", "%u\n", profile->max_power)) {
+		goto done;
+	}
+
+	for (i = 0; i < profile->interfaces; ++i) {
+		if (!profile->interface[i].hid) {
+			continue;
+		}
+		if (!create_function(gadget, config, configfs, i, &profile->interface[i], &reports[i])) {
+			log_fmt(ERROR, "Could not create function\n");
+			goto done;
+		}
+	}
+	ok = true;
+
+done:
+	if (config_strings >= 0) {
+		close(config_strings);
+	}
+	if (config >= 0) {
+		close(config);
+	}
+	if (strings >= 0) {
+		close(strings);
+	}
+	close(gadget);
+	return ok;
+}
+
+static bool function_matches(int gadget, int fn, const struct InterfaceProfile* iface) {
+	char name[48];
+	uint8_t descriptor[DESCRIPTOR_SIZE_MAX + 1];
+	struct ReportTable reports;
+	size_t report_length;
+	ssize_t size;
+	int function;
+	int fd;
+	bool ok;
+
+	snprintf(name, sizeof(name), "functions/hid.usb%d", fn);
+	function = openat(gadget, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (function < 0) {
+		return !iface->hid;
+	}
+	if (!iface->hid) {
+		close(function);
+		return false;
+	}
+	/* Older builds wrote a fixed report length, which is rebuilt rather
+	 * than taken over */
+	report_length = parse_reports(iface, &reports);
+	if (!report_length) {
+		report_length = REPORT_LENGTH_DEFAULT;
+	}
+	ok = attr_is(function, "protocol", iface->protocol) && attr_is(function, "subclass", iface->subclass) &&
+	     attr_is(function, "report_length", report_length);
+	fd = openat(function, "report_desc", O_RDONLY | O_CLOEXEC);
+	close(function);
+	if (!ok || fd < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	size = read(fd, descriptor, sizeof(descriptor));
+	close(fd);
+	if (size != iface->descriptor_size || memcmp(descriptor, iface->descriptor, size) != 0) {
+		return false;
+	}
+
+	snprintf(name, sizeof(name), "configs/c.1/hid.usb%d", fn);
+	return faccessat(gadget, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+bool gadget_matches(const char* configfs, const struct DeviceProfile* profile) {
+	static const struct InterfaceProfile none;
+	int gadget;
+	int strings = -1;
+	int config = -1;
+	int config_strings = -1;
+	bool ok = false;
+	int i;
+
+	gadget = open(configfs, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (gadget < 0) {
+		return false;
+	}
+	strings = openat(gadget, "strings/0x409", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	config = openat(gadget, "configs/c.1", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (strings < 0 || config < 0) {
+		goto done;
+	}
+	config_strings = openat(config, "strings/0x409", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (config_strings < 0) {
+		goto done;
+	}
+
+	if (!attr_is(gadget, "bDeviceProtocol", profile->device_protocol) ||
+	    !attr_is(gadget, "bDeviceSubClass", profile->device_subclass) ||
+	    !attr_is(gadget, "idVendor", profile->vendor_id) ||
+	    !attr_is(gadget, "idProduct", profile->product_id) ||
+	    !attr_is(gadget, "bcdDevice", profile->bcd_device) ||
+	    !attr_is(gadget, "bcdUSB", profile->bcd_usb) ||
+	    !string_is(strings, "manufacturer", profile->manufacturer) ||
+	    !string_is(strings, "product", profile->product) ||
+	    !string_is(strings, "serialnumber", profile->serial) ||
+	    !string_is(config_strings, "configuration", profile->configuration) ||
+	    !attr_is(config, "MaxPower", profile->max_power)) {
+		goto done;
+	}
+	/* A function left over past the last interface changes the gadget too */
+	for (i = 0; i < INTERFACES_MAX; ++i) {
+		if (!function_matches(gadget, i, i < profile->interfaces ? &profile->interface[i] : &none)) {
+			goto done;
+		}
+	}
+	ok = true;
+
+done:
+	if (config_strings >= 0) {
+		close(config_strings);
+	}
+	if (config >= 0) {
+		close(config);
+	}
+	if (strings >= 0) {
+		close(strings);
+	}
+	close(gadget);
+	return ok;
+}
+
+void gadget_adopt(const struct DeviceProfile* profile, struct ReportTable* reports) {
+	int i;
+
+	for (i = 0; i < profile->interfaces; ++i) {
+		if (profile->interface[i].hid) {
+			size_reports(i, &profile->interface[i], &reports[i]);
+		}
+	}
+}
+
+void gadget_remove(const char* configfs, int interfaces) {
+	char name[32];
+	int gadget;
+	int i;
+
+	gadget = open(configfs, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (gadget < 0) {
+		return;
+	}
+	unlinkat(gadget, "strings/0x409", AT_REMOVEDIR);
+	unlinkat(gadget, "configs/c.1/strings/0x409", AT_REMOVEDIR);
+	for (i = 0; i < interfaces; ++i) {
+		snprintf(name, sizeof(name), "configs/c.1/hid.usb%d", i);
+		unlinkat(gadget, name, 0);
+		snprintf(name, sizeof(name), "functions/hid.usb%d", i);
+		unlinkat(gadget, name, AT_REMOVEDIR);
+	}
+	unlinkat(gadget, "configs/c.1", AT_REMOVEDIR);
+	close(gadget);
+	rmdir(configfs);
+}
+
+bool find_udc(char* out, udc_filter taken, void* data) {
+	DIR* dir;
+	struct dirent* dent;
+
+	dir = opendir("/sys/class/udc");
+	if (!dir) {
+		log_errno(ERROR, "Failed to opendir udc");
+		return false;
+	}
+
+	while ((dent = readdir(dir))) {
+		if (dent->d_name[0] == '.') {
+			continue;
+		}
+		if (taken && taken(data, dent->d_name)) {
+			continue;
+		}
+		strncpy(out, dent->d_name, PATH_MAX - 1);
+		break;
+	}
+	closedir(dir);
+	return !!dent;
+}
+
+bool gadget_udc(const char* configfs, char* out) {
+	int gadget;
+	bool bound;
+
+	gadget = open(configfs, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (gadget < 0) {
+		return false;
+	}
+	bound = read_attr(gadget, "UDC", out, PATH_MAX) > 0;
+	close(gadget);
+	return bound;
+}
+
+bool start_udc(const char* configfs, const char* udc) {
+	int fd = vopen("%s/UDC", O_WRONLY | O_TRUNC, 0644, configfs);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open UDC");
+		return false;
+	}
+	if (dprintf(fd, "%s\n", udc) < 0) {
+		log_errno(ERROR, "Failed to start UDC");
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+bool stop_udc(const char* configfs) {
+	int fd = vopen("%s/UDC", O_WRONLY | O_TRUNC, 0644, configfs);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open UDC");
+		return false;
+	}
+	if (write(fd, "\n", 1) < 0) {
+		log_errno(ERROR, "Failed to stop UDC");
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "hist.h"
+#include "log.h"
+
+#include <inttypes.h>
+
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+
+static unsigned bucket_index(uint64_t ns) {
+	unsigned shift;
+
+	if (ns < 2 * HIST_SUB_COUNT) {
+		return ns;
+	}
+	if (ns >> HIST_MAX_BITS) {
+		return HIST_BUCKETS - 1;
+	}
+	shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + (ns >> shift) - HIST_SUB_COUNT;
+}
+
+/* Largest value that lands in a bucket */
+static uint64_t bucket_value(unsigned index) {
+	unsigned shift;
+
+	if (index < 2 * HIST_SUB_COUNT) {
+		return index;
+	}
+	shift = index / HIST_SUB_COUNT - 1;
+	return (((uint64_t) (index % HIST_SUB_COUNT + HIST_SUB_COUNT + 1)) << shift) - 1;
+}
+
+/* Each histogram has a single writer; the relaxed stores only make sure a
+ * concurrent dump never sees torn values */
+void hist_record(struct Hist* hist, uint64_t ns) {
+	unsigned index = bucket_index(ns);
+
+	__atomic_store_n(&hist->buckets[index], hist->buckets[index] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + ns, __ATOMIC_RELAXED);
+	if (ns > hist->max) {
+		__atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t hist_percentile(const struct Hist* hist, double percentile) {
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (!count) {
+		return 0;
+	}
+	target = count * percentile / 100.0;
+	if (target >= count) {
+		return max;
+	}
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen > target) {
+			uint64_t value = bucket_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+void hist_log(const struct Hist* hist, const char* label) {
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+
+	if (!count) {
+		return;
+	}
+	log_fmt(INFO, "  %-16s %10" PRIu64 " samples, avg %8.1f us, p50 %8.1f us, p99 %8.1f us, "
+	        "p99.9 %8.1f us, max %8.1f us\n", label, count,
+	        __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1000.0 / count,
+	        hist_percentile(hist, 50) / 1000.0,
+	        hist_percentile(hist, 99) / 1000.0,
+	        hist_percentile(hist, 99.9) / 1000.0,
+	        __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1000.0);
+}
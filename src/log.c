@@ -1,29 +1,640 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
 #include "log.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Records waiting for the drainer, a power of two */
+#define LOG_RING_SIZE 1024
+#define LOG_ARGS_MAX 12
+/* Room for the strings passed with %s, copied since they may not outlive the
+ * call */
+#define LOG_STRINGS_SIZE 192
+/* Call sites tracked for rate limiting, a power of two */
+#define LOG_SITES 256
+#define LOG_SITE_PROBES 8
+/* Warnings and errors each call site may log per second */
+#define LOG_SITE_BURST 10
+/* How long the drainer sleeps when nothing wakes it */
+#define LOG_DRAIN_MS 100
+#define LOG_SPEC_MAX 32
+
+union LogArg {
+	uint64_t u;
+	int64_t i;
+	double f;
+	/* Offset into strings */
+	uint32_t s;
+};
+
+struct LogRecord {
+	/* Vyukov's sequence: the position it may be written at, plus one once
+	 * it may be read */
+	uint64_t seq;
+	/* NULL once the message was formatted in full into strings, for
+	 * formats the ring does not handle */
+	const char* fmt;
+	/* For log_errno, where fmt is the plain message */
+	int err;
+	bool is_errno;
+	unsigned nargs;
+	union LogArg args[LOG_ARGS_MAX];
+	char strings[LOG_STRINGS_SIZE];
+};
+
+struct LogSite {
+	const char* fmt;
+	/* CLOCK_MONOTONIC_COARSE second the count is for */
+	uint64_t second;
+	uint64_t count;
+	uint64_t suppressed;
+};
+
+enum LogConversion {
+	LOG_CONV_NONE,
+	LOG_CONV_SIGNED,
+	LOG_CONV_UNSIGNED,
+	LOG_CONV_DOUBLE,
+	LOG_CONV_STRING,
+	LOG_CONV_POINTER,
+};
+
+enum LogLength {
+	LOG_LEN_INT,
+	LOG_LEN_CHAR,
+	LOG_LEN_SHORT,
+	LOG_LEN_LONG,
+	LOG_LEN_LONG_LONG,
+	LOG_LEN_SIZE,
+	LOG_LEN_MAX,
+	LOG_LEN_PTRDIFF,
+};
+
+struct LogSpec {
+	const char* start;
+	/* Past the flags, width and precision */
+	const char* length_at;
+	const char* end;
+	enum LogConversion conv;
+	enum LogLength length;
+};
 
 static int _level = DEBUG;
 
+static struct LogRecord ring[LOG_RING_SIZE];
+static uint64_t ring_head;
+/* Only touched by whoever drains */
+static uint64_t ring_tail;
+static struct LogSite sites[LOG_SITES];
+static uint64_t dropped;
+static uint64_t dropped_reported;
+
+static bool running;
+static bool stopping;
+static int waiting;
+static pthread_t drainer;
+
+static uint64_t coarse_second(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/* Finds the next conversion in fmt, or returns false past the last one.
+ * Conversions the ring cannot carry come back as LOG_CONV_NONE. */
+static bool log_next_spec(const char* fmt, struct LogSpec* spec) {
+	const char* p = fmt;
+
+	while (true) {
+		p = strchr(p, '%');
+		if (!p) {
+			return false;
+		}
+		if (p[1] != '%') {
+			break;
+		}
+		p += 2;
+	}
+	spec->start = p++;
+	spec->conv = LOG_CONV_NONE;
+	spec->length = LOG_LEN_INT;
+	p += strspn(p, "-+ #0'");
+	p += strspn(p, "0123456789");
+	if (*p == '.') {
+		++p;
+		p += strspn(p, "0123456789");
+	}
+	spec->length_at = p;
+	switch (*p) {
+	case 'h':
+		if (p[1] == 'h') {
+			spec->length = LOG_LEN_CHAR;
+			p += 2;
+		} else {
+			spec->length = LOG_LEN_SHORT;
+			++p;
+		}
+		break;
+	case 'l':
+		if (p[1] == 'l') {
+			spec->length = LOG_LEN_LONG_LONG;
+			p += 2;
+		} else {
+			spec->length = LOG_LEN_LONG;
+			++p;
+		}
+		break;
+	case 'z':
+		spec->length = LOG_LEN_SIZE;
+		++p;
+		break;
+	case 'j':
+		spec->length = LOG_LEN_MAX;
+		++p;
+		break;
+	case 't':
+		spec->length = LOG_LEN_PTRDIFF;
+		++p;
+		break;
+	}
+	switch (*p) {
+	case 'd':
+	case 'i':
+		spec->conv = LOG_CONV_SIGNED;
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+	case 'c':
+		spec->conv = LOG_CONV_UNSIGNED;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if (spec->length == LOG_LEN_INT) {
+			spec->conv = LOG_CONV_DOUBLE;
+		}
+		break;
+	case 's':
+		if (spec->length == LOG_LEN_INT) {
+			spec->conv = LOG_CONV_STRING;
+		}
+		break;
+	case 'p':
+		spec->conv = LOG_CONV_POINTER;
+		break;
+	}
+	spec->end = *p ? p + 1 : p;
+	return true;
+}
+
+/* Literal text between conversions, with %% back to a single % */
+static void log_literal(const char* start, const char* end) {
+	const char* p;
+
+	while (start < end) {
+		p = memchr(start, '%', end - start);
+		if (!p) {
+			p = end;
+		}
+		fwrite(start, 1, p - start, stderr);
+		if (p == end) {
+			break;
+		}
+		fputc('%', stderr);
+		start = p + 2;
+	}
+}
+
+/* The record widened every integer to 64 bits, so the conversion is handed
+ * one with ll in place of whatever length it was written with */
+static bool log_piece(const struct LogSpec* spec, char* piece, size_t size) {
+	size_t len = spec->length_at - spec->start;
+	char conv = spec->end[-1];
+	bool wide = (spec->conv == LOG_CONV_SIGNED || spec->conv == LOG_CONV_UNSIGNED) && conv != 'c';
+
+	if (len + 4 > size) {
+		return false;
+	}
+	memcpy(piece, spec->start, len);
+	if (wide) {
+		piece[len++] = 'l';
+		piece[len++] = 'l';
+	}
+	piece[len++] = conv;
+	piece[len] = '\0';
+	return true;
+}
+
+static uint64_t log_arg_unsigned(enum LogLength length, va_list* args) {
+	switch (length) {
+	case LOG_LEN_CHAR:
+		return (unsigned char) va_arg(*args, unsigned);
+	case LOG_LEN_SHORT:
+		return (unsigned short) va_arg(*args, unsigned);
+	case LOG_LEN_LONG:
+		return va_arg(*args, unsigned long);
+	case LOG_LEN_LONG_LONG:
+		return va_arg(*args, unsigned long long);
+	case LOG_LEN_SIZE:
+		return va_arg(*args, size_t);
+	case LOG_LEN_MAX:
+		return va_arg(*args, uintmax_t);
+	case LOG_LEN_PTRDIFF:
+		return va_arg(*args, ptrdiff_t);
+	default:
+		return va_arg(*args, unsigned);
+	}
+}
+
+static int64_t log_arg_signed(enum LogLength length, va_list* args) {
+	switch (length) {
+	case LOG_LEN_CHAR:
+		return (signed char) va_arg(*args, int);
+	case LOG_LEN_SHORT:
+		return (short) va_arg(*args, int);
+	case LOG_LEN_LONG:
+		return va_arg(*args, long);
+	case LOG_LEN_LONG_LONG:
+		return va_arg(*args, long long);
+	case LOG_LEN_SIZE:
+		return va_arg(*args, ssize_t);
+	case LOG_LEN_MAX:
+		return va_arg(*args, intmax_t);
+	case LOG_LEN_PTRDIFF:
+		return va_arg(*args, ptrdiff_t);
+	default:
+		return va_arg(*args, int);
+	}
+}
+
+/* Keeps the raw arguments, so only the drainer pays for formatting. Returns
+ * false for anything the record cannot hold, which is then formatted here. */
+static bool log_capture(struct LogRecord* rec, const char* fmt, va_list* args) {
+	struct LogSpec spec;
+	const char* str;
+	size_t used = 0;
+	size_t len;
+
+	rec->nargs = 0;
+	while (log_next_spec(fmt, &spec)) {
+		fmt = spec.end;
+		if (spec.conv == LOG_CONV_NONE || rec->nargs == LOG_ARGS_MAX) {
+			return false;
+		}
+		union LogArg* arg = &rec->args[rec->nargs++];
+		switch (spec.conv) {
+		case LOG_CONV_SIGNED:
+			arg->i = log_arg_signed(spec.length, args);
+			break;
+		case LOG_CONV_UNSIGNED:
+			arg->u = log_arg_unsigned(spec.length, args);
+			break;
+		case LOG_CONV_DOUBLE:
+			arg->f = va_arg(*args, double);
+			break;
+		case LOG_CONV_POINTER:
+			arg->u = (uintptr_t) va_arg(*args, void*);
+			break;
+		case LOG_CONV_STRING:
+			str = va_arg(*args, const char*);
+			if (!str) {
+				str = "(null)";
+			}
+			len = strlen(str) + 1;
+			if (len > sizeof(rec->strings) - used) {
+				return false;
+			}
+			memcpy(&rec->strings[used], str, len);
+			arg->s = used;
+			used += len;
+			break;
+		case LOG_CONV_NONE:
+			break;
+		}
+	}
+	return true;
+}
+
+static void log_replay(const struct LogRecord* rec) {
+	const union LogArg* arg = rec->args;
+	const char* fmt = rec->fmt;
+	struct LogSpec spec;
+	char piece[LOG_SPEC_MAX];
+	char error[128];
+
+	if (rec->is_errno) {
+		fprintf(stderr, "%s: %s\n", fmt, strerror_r(rec->err, error, sizeof(error)));
+		return;
+	}
+	if (!fmt) {
+		fputs(rec->strings, stderr);
+		return;
+	}
+	while (log_next_spec(fmt, &spec)) {
+		log_literal(fmt, spec.start);
+		fmt = spec.end;
+		if (!log_piece(&spec, piece, sizeof(piece))) {
+			++arg;
+			continue;
+		}
+		switch (spec.conv) {
+		case LOG_CONV_SIGNED:
+			fprintf(stderr, piece, (long long) arg->i);
+			break;
+		case LOG_CONV_UNSIGNED:
+			if (spec.end[-1] == 'c') {
+				fprintf(stderr, piece, (int) arg->u);
+			} else {
+				fprintf(stderr, piece, (unsigned long long) arg->u);
+			}
+			break;
+		case LOG_CONV_DOUBLE:
+			fprintf(stderr, piece, arg->f);
+			break;
+		case LOG_CONV_STRING:
+			fprintf(stderr, piece, &rec->strings[arg->s]);
+			break;
+		case LOG_CONV_POINTER:
+			fprintf(stderr, piece, (void*) (uintptr_t) arg->u);
+			break;
+		case LOG_CONV_NONE:
+			break;
+		}
+		++arg;
+	}
+	log_literal(fmt, fmt + strlen(fmt));
+}
+
+static struct LogRecord* ring_claim(uint64_t* pos) {
+	struct LogRecord* rec;
+	uint64_t seq;
+	int64_t diff;
+
+	*pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	while (true) {
+		rec = &ring[*pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) (seq - *pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring_head, pos, *pos + 1, true,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				return rec;
+			}
+		} else if (diff < 0) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			*pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void ring_publish(struct LogRecord* rec, uint64_t pos) {
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+	/* Pairs with the drainer setting waiting before it looks at the ring
+	 * one last time */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&waiting, 0, __ATOMIC_ACQ_REL)) {
+		syscall(SYS_futex, &waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static bool ring_pending(void) {
+	const struct LogRecord* rec = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+
+	return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == ring_tail + 1;
+}
+
+static void ring_drain(void) {
+	struct LogRecord* rec;
+
+	while (ring_pending()) {
+		rec = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+		log_replay(rec);
+		__atomic_store_n(&rec->seq, ring_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		++ring_tail;
+	}
+}
+
+/* Counts a warning or error against its call site, telling by the format
+ * string. Sites past what the table holds are never limited. */
+static bool log_site_allowed(const char* fmt) {
+	struct LogSite* site = NULL;
+	const char* owner;
+	uint64_t second;
+	unsigned hash = ((uintptr_t) fmt * 0x9e3779b97f4a7c15ull) >> 56;
+	int i;
+
+	for (i = 0; i < LOG_SITE_PROBES; ++i) {
+		site = &sites[(hash + i) & (LOG_SITES - 1)];
+		owner = __atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE);
+		if (!owner) {
+			__atomic_compare_exchange_n(&site->fmt, &owner, fmt, false,
+			                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+			if (!owner) {
+				owner = fmt;
+			}
+		}
+		if (owner == fmt) {
+			break;
+		}
+		site = NULL;
+	}
+	if (!site) {
+		return true;
+	}
+
+	second = coarse_second();
+	if (__atomic_load_n(&site->second, __ATOMIC_RELAXED) != second) {
+		/* Racing threads may both reset, which only lets a few more by */
+		__atomic_store_n(&site->second, second, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < LOG_SITE_BURST) {
+		return true;
+	}
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/* Owes a line for each call site that went quiet after being cut off, or for
+ * every one of them once all is said and done */
+static void log_summarize(bool all) {
+	struct LogSite* site;
+	const char* fmt;
+	uint64_t second = coarse_second();
+	uint64_t count;
+	size_t len;
+	int i;
+
+	for (i = 0; i < LOG_SITES; ++i) {
+		site = &sites[i];
+		fmt = __atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE);
+		if (!fmt || !__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if (!all && __atomic_load_n(&site->second, __ATOMIC_RELAXED) == second) {
+			continue;
+		}
+		count = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		len = strcspn(fmt, "\n");
+		fprintf(stderr, "Suppressed %" PRIu64 " more of: %.*s\n", count, (int) len, fmt);
+	}
+
+	count = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (count != dropped_reported) {
+		fprintf(stderr, "Log ring full, dropped %" PRIu64 " messages\n", count - dropped_reported);
+		dropped_reported = count;
+	}
+}
+
+static void* log_thread(void* arg) {
+	struct timespec timeout = {
+		.tv_sec = LOG_DRAIN_MS / 1000,
+		.tv_nsec = (LOG_DRAIN_MS % 1000) * 1000000,
+	};
+
+	(void) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		ring_drain();
+		log_summarize(false);
+		__atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+		if (ring_pending() || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		syscall(SYS_futex, &waiting, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+		__atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void log_record(const char* fmt, int err, bool is_errno, va_list* args) {
+	struct LogRecord* rec;
+	uint64_t pos;
+	va_list copy;
+
+	rec = ring_claim(&pos);
+	if (!rec) {
+		return;
+	}
+	rec->fmt = fmt;
+	rec->err = err;
+	rec->is_errno = is_errno;
+	if (!is_errno) {
+		va_copy(copy, *args);
+		if (!log_capture(rec, fmt, args)) {
+			vsnprintf(rec->strings, sizeof(rec->strings), fmt, copy);
+			rec->fmt = NULL;
+		}
+		va_end(copy);
+	}
+	ring_publish(rec, pos);
+}
+
 __attribute__((format(printf, 2, 3)))
 void log_fmt(enum LogLevel level, const char* fmt, ...) {
 	if ((int) level > _level) {
 		return;
 	}
+	if (level <= WARN && !log_site_allowed(fmt)) {
+		return;
+	}
 	va_list args;
 	va_start(args, fmt);
-	vfprintf(stderr, fmt, args);
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		log_record(fmt, 0, false, &args);
+	} else {
+		vfprintf(stderr, fmt, args);
+	}
 	va_end(args);
 }
 
 void log_errno(enum LogLevel level, const char* msg) {
+	int err = errno;
+
 	if ((int) level > _level) {
 		return;
 	}
-	perror(msg);
+	if (level <= WARN && !log_site_allowed(msg)) {
+		errno = err;
+		return;
+	}
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		log_record(msg, err, true, NULL);
+	} else {
+		perror(msg);
+	}
+	errno = err;
 }
 
 void set_log_level(enum LogLevel level) {
 	_level = level;
 }
+
+bool log_start(void) {
+	sigset_t all;
+	sigset_t old;
+	int i;
+	int ret;
+
+	for (i = 0; i < LOG_RING_SIZE; ++i) {
+		ring[i].seq = i;
+	}
+	ring_head = 0;
+	ring_tail = 0;
+	stopping = false;
+
+	/* The drainer takes none of the process' signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&drainer, NULL, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		log_errno(ERROR, "Failed to start log thread");
+		return false;
+	}
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void log_stop(void) {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	if (__atomic_exchange_n(&waiting, 0, __ATOMIC_ACQ_REL)) {
+		syscall(SYS_futex, &waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+	pthread_join(drainer, NULL);
+	ring_drain();
+	log_summarize(true);
+}
+
+uint64_t log_dropped(void) {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
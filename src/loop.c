@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "log.h"
+#include "loop.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define LOOP_EVENTS_MAX 16
+
+bool loop_init(struct Loop* loop) {
+	memset(&loop->spin, 0, sizeof(loop->spin));
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		log_errno(ERROR, "Failed to create epoll instance");
+		return false;
+	}
+	return true;
+}
+
+void loop_free(struct Loop* loop) {
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+		loop->epfd = -1;
+	}
+}
+
+bool loop_add(struct Loop* loop, struct LoopSource* source) {
+	struct epoll_event event = {
+		.events = source->events,
+		.data.ptr = source,
+	};
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, source->fd, &event) < 0) {
+		log_errno(ERROR, "Failed to add fd to epoll");
+		return false;
+	}
+	return true;
+}
+
+bool loop_mod(struct Loop* loop, struct LoopSource* source, uint32_t events) {
+	struct epoll_event event = {
+		.events = events,
+		.data.ptr = source,
+	};
+	if (source->events == events) {
+		return true;
+	}
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, source->fd, &event) < 0) {
+		log_errno(ERROR, "Failed to modify epoll fd");
+		return false;
+	}
+	source->events = events;
+	return true;
+}
+
+void loop_del(struct Loop* loop, struct LoopSource* source) {
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/* Returns how many events were handled, or -1 on error */
+static int loop_poll(struct Loop* loop, int timeout) {
+	struct epoll_event events[LOOP_EVENTS_MAX];
+	int ret;
+	int i;
+
+	ret = epoll_wait(loop->epfd, events, LOOP_EVENTS_MAX, timeout);
+	if (ret < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		log_errno(ERROR, "Failed to wait for events");
+		return -1;
+	}
+	if (!ret) {
+		return 0;
+	}
+	loop->woken_ns = now_ns();
+	for (i = 0; i < ret; ++i) {
+		struct LoopSource* source = events[i].data.ptr;
+		if (!source->handler(source, events[i].events)) {
+			return -1;
+		}
+	}
+	return ret;
+}
+
+bool loop_dispatch(struct Loop* loop, int timeout) {
+	return loop_poll(loop, timeout) >= 0;
+}
+
+/* Until when to spin after the last report, or 0 to sleep instead */
+static uint64_t loop_spin_deadline(struct Loop* loop) {
+	struct LoopSpin* spin = &loop->spin;
+	uint64_t now;
+	uint64_t deadline;
+
+	if (!spin->reported) {
+		return 0;
+	}
+	spin->reported = false;
+	/* Reports this far apart would mostly be waited for in vain */
+	if (!spin->interval_ns || spin->interval_ns > spin->window_ns) {
+		return 0;
+	}
+	now = now_ns();
+	if (now - spin->period_start >= LOOP_SPIN_PERIOD_NS) {
+		spin->period_start = now;
+		spin->period_spent = 0;
+	}
+	if (spin->period_spent >= spin->budget_ns) {
+		counter_add(&spin->stats.throttled, 1);
+		return 0;
+	}
+	/* Until the next report is due, with some slack for jitter */
+	deadline = spin->last_report_ns + spin->interval_ns + spin->interval_ns / 4;
+	if (deadline > now + spin->budget_ns - spin->period_spent) {
+		deadline = now + spin->budget_ns - spin->period_spent;
+	}
+	return deadline > now ? deadline : 0;
+}
+
+static int loop_spin(struct Loop* loop, uint64_t deadline, const bool* stop) {
+	struct LoopSpin* spin = &loop->spin;
+	uint64_t start = now_ns();
+	uint64_t now = start;
+	int ret = 0;
+
+	while (!*stop && now < deadline) {
+		ret = loop_poll(loop, 0);
+		if (ret) {
+			break;
+		}
+		now = now_ns();
+	}
+	now = now_ns();
+	spin->period_spent += now - start;
+	counter_add(&spin->stats.spins, 1);
+	counter_add(&spin->stats.spin_ns, now - start);
+	if (ret > 0) {
+		counter_add(&spin->stats.wins, 1);
+	}
+	return ret;
+}
+
+bool loop_run(struct Loop* loop, const bool* stop) {
+	uint64_t deadline;
+	int ret;
+
+	while (!*stop) {
+		deadline = loop->spin.window_ns ? loop_spin_deadline(loop) : 0;
+		if (deadline) {
+			ret = loop_spin(loop, deadline, stop);
+		} else {
+			ret = loop_poll(loop, -1);
+		}
+		if (ret < 0) {
+			return *stop;
+		}
+	}
+	return true;
+}
+
+void loop_busy_poll(struct Loop* loop, uint64_t window_ns, unsigned budget) {
+	loop->spin.window_ns = window_ns;
+	loop->spin.budget_ns = LOOP_SPIN_PERIOD_NS * budget / 100;
+}
+
+void loop_report(struct Loop* loop) {
+	struct LoopSpin* spin = &loop->spin;
+	uint64_t interval;
+
+	if (!spin->window_ns) {
+		return;
+	}
+	/* Reports read in the same wakeup say nothing about the interval */
+	if (spin->last_report_ns && loop->woken_ns != spin->last_report_ns) {
+		interval = loop->woken_ns - spin->last_report_ns;
+		/* So a pause in the reports does not keep the loop from spinning
+		 * for long once they resume */
+		if (interval > spin->window_ns * 2) {
+			interval = spin->window_ns * 2;
+		}
+		spin->interval_ns = spin->interval_ns ? (spin->interval_ns * 7 + interval) / 8 : interval;
+	}
+	spin->last_report_ns = loop->woken_ns;
+	spin->reported = true;
+}
+
+void loop_log_stats(const struct Loop* loop) {
+	const struct LoopSpinStats* stats = &loop->spin.stats;
+
+	if (!stats->spins && !stats->throttled) {
+		return;
+	}
+	log_fmt(INFO, "Busy poll: %" PRIu64 " spins, %" PRIu64 " won (%.1f%%), %" PRIu64 " throttled, "
+	        "%.3f s spinning, report interval %.1f us\n", stats->spins, stats->wins,
+	        stats->spins ? 100.0 * stats->wins / stats->spins : 0.0, stats->throttled,
+	        stats->spin_ns / 1e9, loop->spin.interval_ns / 1000.0);
+}
+
+bool loop_stop_handler(struct LoopSource* source, uint32_t events) {
+	(void) source;
+	(void) events;
+	return false;
+}
@@ -1,392 +1,243 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
-#include "dev.h"
+#include "capture.h"
+#include "control.h"
+#include "forward.h"
 #include "log.h"
+#include "loop.h"
 #include "options.h"
-#include "usb.h"
+#include "output.h"
+#include "realtime.h"
+#include "session.h"
+#include "threads.h"
+#include "uevent.h"
+#include "uring.h"
 #include "util.h"
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
-#include <linux/hidraw.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/fcntl.h>
-#include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define DESCRIPTOR_SIZE_MAX 4096
-#define REPORT_SIZE_MAX 4096
-#define INTERFACES_MAX 8
-
-struct usb_hidg_report {
-	uint16_t length;
-	uint8_t data[64];
-};
-
-#define GADGET_HID_READ_SET_REPORT	_IOR('g', 0x41, struct usb_hidg_report)
-#define GADGET_HID_WRITE_GET_REPORT	_IOW('g', 0x42, struct usb_hidg_report)
-
 bool did_hup = false;
 
 void hup(int) {
 	did_hup = true;
 }
 
-bool create_configfs(const char* configfs, const char* syspath) {
-	int outfd = -1;
-	int infd = -1;
-	char tmp[16];
-	size_t i;
+/* We want to exit cleanly in event of SIGINT or SIGHUP */
+static void catch_hup(void) {
+	struct sigaction sa;
 
-	if (mkdir(configfs, 0755) == -1 && errno != EEXIST) {
-		log_errno(ERROR, "Failed to make configfs directory");
-		return false;
-	}
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = hup;
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+}
 
-	if (vmkdir("%s/configs/c.1", 0755, configfs) == -1 && errno != EEXIST) {
-		log_errno(ERROR, "Failed to make configfs configs directory");
-		return false;
-	}
-	if (vmkdir("%s/strings/0x409", 0755, configfs) == -1 && errno != EEXIST) {
-		log_errno(ERROR, "Failed to make configfs strings directory");
-		return false;
-	}
-	if (vmkdir("%s/configs/c.1/strings/0x409", 0755, configfs) == -1 && errno != EEXIST) {
-		log_errno(ERROR, "Failed to make configfs configs strings directory");
-		return false;
-	}
+static void log_stats(const struct Session* sessions, int count) {
+	uint64_t dropped = log_dropped();
+	int i;
 
-	if (!cp_prop(syspath, "bDeviceProtocol", configfs, "bDeviceProtocol")) {
-		return false;
-	}
-	if (!cp_prop(syspath, "bDeviceSubClass", configfs, "bDeviceSubClass")) {
-		return false;
-	}
-	if (!cp_prop(syspath, "manufacturer", configfs, "strings/0x409/manufacturer")) {
-		return false;
-	}
-	if (!cp_prop(syspath, "product", configfs, "strings/0x409/product")) {
-		return false;
+	for (i = 0; i < count; ++i) {
+		if (sessions[i].count) {
+			session_log_stats(&sessions[i]);
+		}
 	}
-	if (!cp_prop(syspath, "serial", configfs, "strings/0x409/serialnumber")) {
-		return false;
-	}
-	if (!cp_prop(syspath, "configuration", configfs, "configs/c.1/strings/0x409/configuration")) {
-		return false;
+	if (dropped) {
+		log_fmt(INFO, "%" PRIu64 " log messages dropped to a full log queue\n", dropped);
 	}
+}
 
-	if (!cp_prop_hex(syspath, "idVendor", configfs, "idVendor")) {
-		return false;
-	}
-	if (!cp_prop_hex(syspath, "idProduct", configfs, "idProduct")) {
-		return false;
-	}
-	if (!cp_prop_hex(syspath, "bcdDevice", configfs, "bcdDevice")) {
-		return false;
-	}
+/* Logs the statistics of every session on SIGUSR1 */
+struct StatsDump {
+	struct LoopSource source;
+	const struct Session* sessions;
+	int count;
+};
 
-	infd = vopen("%s/version", O_RDONLY, 0666, syspath);
-	if (infd < 0) {
-		log_errno(ERROR, "Failed to open version input file");
-		return false;
-	}
-	if (read(infd, tmp, sizeof(tmp)) < 0) {
-		log_errno(ERROR, "Failed to read version file");
-		close(infd);
-		return false;
-	}
-	close(infd);
-	/* Convert from human readable to BCD: */
-	/* s/^ (.)\.(...)/0x0\1\2/m */
-	tmp[6] = tmp[5];
-	tmp[5] = tmp[4];
-	tmp[4] = tmp[3];
-	tmp[3] = tmp[1];
-	tmp[0] = '0';
-	tmp[1] = 'x';
-	tmp[2] = '0';
-	outfd = vopen("%s/bcdUSB", O_WRONLY, 0666, configfs);
-	if (outfd < 0) {
-		log_errno(ERROR, "Failed to open version output file");
-		return false;
-	}
-	if (write(outfd, tmp, 7) != 7) {
-		log_errno(ERROR, "Failed to write version output file");
-		close(outfd);
-		return false;
-	}
-	close(outfd);
+static bool stats_dump_handler(struct LoopSource* source, uint32_t) {
+	struct StatsDump* dump = source->data;
+	struct signalfd_siginfo info;
 
-	infd = vopen("%s/bMaxPower", O_RDONLY, 0666, syspath);
-	if (infd < 0) {
-		log_errno(ERROR, "Failed to open max power input file");
-		return false;
+	while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+		log_stats(dump->sessions, dump->count);
 	}
-	if (read(infd, tmp, sizeof(tmp)) < 0) {
-		log_errno(ERROR, "Failed to read max power file");
-		close(infd);
-		return false;
-	}
-	close(infd);
-	/* Chop off units */
-	for (i = 0; i < sizeof(tmp) - 1; ++i) {
-		if (isdigit(tmp[i])) {
-			continue;
-		}
-		if (tmp[i] == 'm') {
-			tmp[i] = '\n';
-			tmp[i + 1] = '\0';
-			break;
-		}
-		return false;
-	}
-	if (i == sizeof(tmp) - 1) {
-		return false;
-	}
-	outfd = vopen("%s/configs/c.1/MaxPower", O_WRONLY, 0666, configfs);
-	if (outfd < 0) {
-		log_errno(ERROR, "Failed to open max power output file");
-		return false;
-	}
-	if (write(outfd, tmp, strlen(tmp)) < 0) {
-		log_errno(ERROR, "Failed to write max power output file");
-		close(outfd);
-		return false;
-	}
-	close(outfd);
-
 	return true;
 }
 
-bool create_configfs_function(const char* configfs, const char* syspath, int fn) {
-	char function[PATH_MAX];
-	char interface[PATH_MAX];
-	char report_descriptor[DESCRIPTOR_SIZE_MAX];
-	int infd;
-	int outfd = -1;
-	ssize_t desc_size;
-
-	snprintf(function, sizeof(function), "%s/functions/hid.usb%d", configfs, fn);
-	if (mkdir(function, 0755) == -1 && errno != EEXIST) {
-		log_errno(ERROR, "Failed to make configfs function directory");
-		return false;
-	}
-
-	if (!cp_prop(syspath, "bInterfaceProtocol", function, "protocol")) {
-		return false;
-	}
-	if (!cp_prop(syspath, "bInterfaceSubClass", function, "subclass")) {
-		return false;
-	}
+static bool stats_dump_init(struct StatsDump* dump, struct Loop* loop, const struct Session* sessions, int count) {
+	sigset_t mask;
 
-	if (!find_function(syspath, interface, sizeof(interface))) {
-		log_fmt(ERROR, "Failed to find function\n");
+	/* Blocked before any thread is started, so they all inherit it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		log_errno(ERROR, "Failed to block SIGUSR1");
 		return false;
 	}
-	infd = vopen("%s/report_descriptor", O_RDONLY, 0666, interface);
-	if (infd < 0) {
-		log_errno(ERROR, "Failed to open report descriptor input file");
+	dump->source.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (dump->source.fd < 0) {
+		log_errno(ERROR, "Failed to create signalfd");
 		return false;
 	}
-
-	desc_size = read(infd, report_descriptor, sizeof(report_descriptor));
-	if (desc_size <= 0) {
-		log_errno(ERROR, "Failed to read report descriptor file");
+	dump->source.events = EPOLLIN;
+	dump->source.handler = stats_dump_handler;
+	dump->source.data = dump;
+	dump->sessions = sessions;
+	dump->count = count;
+	if (!loop_add(loop, &dump->source)) {
+		close(dump->source.fd);
 		return false;
 	}
+	return true;
+}
 
-	outfd = vopen("%s/report_desc", O_WRONLY | O_TRUNC, 0666, function);
-	if (outfd < 0) {
-		log_errno(ERROR, "Failed to open report descriptor output file");
-		return false;
-	}
+static void stats_dump_free(struct StatsDump* dump, struct Loop* loop) {
+	loop_del(loop, &dump->source);
+	close(dump->source.fd);
+}
 
-	if (write(outfd, report_descriptor, desc_size) != desc_size) {
-		log_errno(ERROR, "Failed to write report descriptor file");
-		close(outfd);
-		return false;
-	}
-	close(outfd);
+/* Passes device hotplug events on to every session, for --reattach */
+struct Reattach {
+	struct UeventMonitor monitor;
+	struct Session* sessions;
+	int count;
+};
 
+static bool reattach_uevent(void* data, const struct Uevent* event) {
+	struct Reattach* reattach = data;
+	int i;
 
-	outfd = vopen("%s/report_length", O_WRONLY | O_TRUNC, 0666, function);
-	if (outfd < 0) {
-		log_errno(ERROR, "Failed to open report length file");
-		return false;
+	if (strcmp(event->action, "add") != 0 || strcmp(event->subsystem, "hidraw") != 0) {
+		return true;
 	}
-	if (dprintf(outfd, "%02i", 64) < 2) {
-		log_errno(ERROR, "Failed to write report length file");
-		close(outfd);
-		return false;
+	for (i = 0; i < reattach->count; ++i) {
+		if (!session_reattach(&reattach->sessions[i], event)) {
+			return false;
+		}
 	}
-	close(outfd);
+	return true;
+}
 
-	snprintf(interface, sizeof(interface), "%s/configs/c.1/hid.usb%d", configfs, fn);
-	if (symlink(function, interface) < 0) {
-		log_errno(ERROR, "Failed to symlink interface config");
-		return false;
-	}
+/* How long each phase of bringing up the gadget took, for --timing */
+struct Timing {
+	bool enabled;
+	uint64_t start;
+	uint64_t last;
+};
 
-	return true;
+static void timing_start(struct Timing* timing, bool enabled) {
+	timing->enabled = enabled;
+	timing->start = now_ns();
+	timing->last = timing->start;
 }
 
-bool find_udc(char* out) {
-	DIR* dir;
-	struct dirent* dent;
+static void timing_mark(struct Timing* timing, const char* phase) {
+	uint64_t now = now_ns();
 
-	dir = opendir("/sys/class/udc");
-	if (!dir) {
-		log_errno(ERROR, "Failed to opendir udc");
-		return false;
+	if (timing->enabled) {
+		log_fmt(INFO, "Setup: %-14s %8.3f ms\n", phase, (now - timing->last) / 1e6);
 	}
+	timing->last = now;
+}
 
-	while ((dent = readdir(dir))) {
-		if (dent->d_name[0] == '.') {
-			continue;
-		}
-		strncpy(out, dent->d_name, PATH_MAX - 1);
-		break;
+static void timing_total(const struct Timing* timing) {
+	if (timing->enabled) {
+		log_fmt(INFO, "Setup: %-14s %8.3f ms\n", "total", (timing->last - timing->start) / 1e6);
 	}
-	closedir(dir);
-	return !!dent;
 }
 
-bool start_udc(const char* configfs, const char* udc) {
-	int fd = vopen("%s/UDC", O_WRONLY | O_TRUNC, 0644, configfs);
-	if (fd < 0) {
-		log_errno(ERROR, "Failed to open UDC");
-		return false;
-	}
-	if (dprintf(fd, "%s\n", udc) < 0) {
-		log_errno(ERROR, "Failed to start UDC");
-		close(fd);
-		return false;
-	}
-	close(fd);
-	return true;
+static struct ThreadConfig thread_config(const struct Options* opts, int thread) {
+	struct ThreadConfig config = {
+		.cpu = opts->ncpus ? opts->cpus[thread % opts->ncpus] : -1,
+		.priority = opts->priority,
+		.busy_poll_ns = opts->busy_poll_us * 1000ULL,
+		.busy_poll_budget = opts->busy_poll_budget,
+	};
+	return config;
 }
 
-bool stop_udc(const char* configfs) {
-	int fd = vopen("%s/UDC", O_WRONLY | O_TRUNC, 0644, configfs);
-	if (fd < 0) {
-		log_errno(ERROR, "Failed to open UDC");
+bool run_threads(struct Loop* loop, struct FeatureWorker* feature_worker, struct Interface* interfaces, int count, const struct Options* opts) {
+	struct ForwardThread* threads;
+	struct ThreadConfig config;
+	struct LoopSource shutdown = {
+		.events = EPOLLIN,
+		.handler = loop_stop_handler,
+	};
+	uint64_t one = 1;
+	bool ret = false;
+	int started;
+
+	threads = calloc(count, sizeof(*threads));
+	if (!threads) {
+		log_errno(ERROR, "Failed to allocate threads");
 		return false;
 	}
-	if (write(fd, "\n", 1) < 0) {
-		log_errno(ERROR, "Failed to stop UDC");
-		close(fd);
+	shutdown.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shutdown.fd < 0) {
+		log_errno(ERROR, "Failed to create shutdown eventfd");
+		free(threads);
+		return false;
+	}
+	if (!loop_add(loop, &shutdown)) {
+		close(shutdown.fd);
+		free(threads);
 		return false;
 	}
-	close(fd);
-	return true;
-}
 
-bool poll_fds(int* infds, int* outfds, nfds_t nfds) {
-	struct pollfd fds[INTERFACES_MAX * 2];
-	struct pollfd outpoll;
-	uint8_t buffer[REPORT_SIZE_MAX];
-	ssize_t sizein;
-	ssize_t sizeout;
-	ssize_t loc;
-	struct usb_hidg_report set_report;
-	struct usb_hidg_report get_report = { 64, { 0 } };
-	nfds_t i;
-
-	for (i = 0; i < nfds; ++i) {
-		fds[i * 2].fd = infds[i];
-		fds[i * 2].events = POLLIN;
-		fds[i * 2 + 1].fd = outfds[i];
-		fds[i * 2 + 1].events = POLLIN | POLLPRI;
-	}
-
-	while (!did_hup) {
-		int ret = poll(fds, nfds * 2, -1);
-		if (ret == -EAGAIN) {
-			continue;
-		}
-		if (ret < 0) {
-			if (errno != EINTR) {
-				log_errno(ERROR, "Failed to poll nodes");
-			}
-			return did_hup;
-		}
-		for (i = 0; i < nfds * 2; ++i) {
-			if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				return did_hup;
-			}
-			if (fds[i].revents & POLLPRI) {
-				if (ioctl(fds[i].fd, GADGET_HID_READ_SET_REPORT, &set_report) < 0) {
-					log_errno(ERROR, "SET ioctl in failed");
-				}
-				if (ioctl(fds[i ^ 1].fd, HIDIOCSFEATURE(set_report.length), set_report.data) < 0) {
-					log_errno(ERROR, "SET ioctl out failed");
-				}
-				get_report.data[0] = set_report.data[0];
-				if (ioctl(fds[i ^ 1].fd, HIDIOCGFEATURE(64), get_report.data) < 0) {
-					log_errno(ERROR, "GET ioctl in failed");
-				}
-				if (get_report.data[0] == set_report.data[0] && ioctl(fds[i].fd, GADGET_HID_WRITE_GET_REPORT, &get_report) < 0) {
-					log_errno(ERROR, "GET ioctl out failed");
-				}
-				memset(get_report.data, 0, sizeof(get_report.data));
-				fds[i].revents &= ~POLLPRI;
-			}
-			if (fds[i].revents & POLLIN) {
-				outpoll.fd = fds[i ^ 1].fd;
-				outpoll.events = POLLOUT;
-				outpoll.revents = 0;
-				if (poll(&outpoll, 1, 0) != 1) {
-					continue;
-				}
-
-				sizein = read(fds[i].fd, buffer, sizeof(buffer));
-				if (sizein < 0) {
-					if (errno != EINTR) {
-						log_errno(ERROR, "Failed to read packet");
-					}
-					return did_hup;
-				}
-				loc = 0;
-				while (sizein > 0) {
-					sizeout = write(fds[i ^ 1].fd, &buffer[loc], sizein);
-					if (sizeout < 0) {
-						if (errno == EAGAIN) {
-							break;
-						}
-						if (errno != EINTR) {
-							log_errno(ERROR, "Failed to write packet");
-						}
-						return did_hup;
-					}
-					loc += sizeout;
-					sizein -= sizeout;
-				}
-				fds[i].revents &= ~POLLIN;
-			}
+	for (started = 0; started < count; ++started) {
+		config = thread_config(opts, started);
+		if (!forward_thread_start(&threads[started], &interfaces[started], feature_worker, shutdown.fd, &did_hup, &config)) {
+			break;
 		}
 	}
-	return true;
+	if (started == count) {
+		/* The main thread only handles signals and feature completions */
+		ret = loop_run(loop, &did_hup);
+	}
+
+	if (write(shutdown.fd, &one, sizeof(one)) < 0) {
+		log_errno(ERROR, "Failed to signal shutdown");
+	}
+	while (started--) {
+		forward_thread_join(&threads[started]);
+	}
+	loop_del(loop, &shutdown);
+	close(shutdown.fd);
+	free(threads);
+	return ret;
 }
 
 int main(int argc, char* argv[]) {
-	char syspath[PATH_MAX];
-	char syspath_tmp[PATH_MAX];
-	char configfs[PATH_MAX];
-	char udc[PATH_MAX];
-	char bus_id[32];
-	int hidg[INTERFACES_MAX];
-	int hidraw[INTERFACES_MAX];
-	bool is_hid[INTERFACES_MAX];
-	int ret;
-	int max_interfaces = 0;
-	int i, j;
-	struct sigaction sa;
+	char name[NAME_MAX + 1];
+	struct Session* sessions = NULL;
+	struct Interface* interfaces = NULL;
+	struct Loop loop;
+	struct StatsDump stats_dump;
+	struct Reattach reattach;
+	struct FeatureWorker feature_worker;
+	struct Control control;
+	struct Realtime realtime;
+	struct ThreadConfig config;
+	struct Uring ring;
+	struct Timing timing;
+	static struct Capture capture;
+	static struct Capture replay_capture;
+	static struct Replay replay;
+	int nsessions = 0;
+	int ninterfaces = 0;
+	int open_interfaces = 0;
+	bool added;
+	int i;
 	struct Options opts = {0};
 	int ok = 1;
 
@@ -399,117 +250,209 @@ int main(int argc, char* argv[]) {
 		ok = 0;
 		goto early_shutdown;
 	}
-
-	if (!find_sysfs_path(opts.dev, syspath, bus_id)) {
+	if (opts.realtime) {
+		realtime_prepare();
+	}
+	if (!log_start()) {
 		goto early_shutdown;
 	}
-
-	max_interfaces = interface_count(syspath);
-	if (max_interfaces < 0) {
+	if (opts.jitter_test) {
+		config = thread_config(&opts, 0);
+		if (opts.realtime && !realtime_lock()) {
+			goto early_shutdown;
+		}
+		catch_hup();
+		ok = !realtime_jitter_test(&config, opts.jitter_test, JITTER_INTERVAL_US, &did_hup);
 		goto early_shutdown;
 	}
 
-	if (max_interfaces > INTERFACES_MAX) {
-		max_interfaces = INTERFACES_MAX;
+	timing_start(&timing, opts.timing);
+	sessions = calloc(opts.replay ? 1 : opts.ndevs, sizeof(*sessions));
+	if (!sessions) {
+		log_errno(ERROR, "Failed to allocate sessions");
+		goto early_shutdown;
 	}
+	if (opts.replay) {
+		if (!capture_load(&replay_capture, opts.replay) || !replay_init(&replay, &replay_capture, opts.replay_fast)) {
+			goto shutdown;
+		}
+		session_init(&sessions[nsessions], opts.name, opts.udc);
+		session_replay(&sessions[nsessions++], &replay);
+	}
+	for (i = 0; i < opts.ndevs; ++i) {
+		if (opts.composite && i > 0) {
+			added = session_add_source(&sessions[0], opts.devs[i], NULL);
+		} else {
+			if (opts.ndevs > 1 && !opts.composite) {
+				snprintf(name, sizeof(name), "%s%d", opts.name, i);
+			} else {
+				snprintf(name, sizeof(name), "%s", opts.name);
+			}
+			session_init(&sessions[nsessions], name, opts.udcs[i] ? opts.udcs[i] : opts.udc);
+			if (opts.profile) {
+				added = session_load_profile(&sessions[nsessions++], opts.devs[i], opts.profile);
+			} else {
+				added = session_add_source(&sessions[nsessions++], opts.devs[i], NULL);
+			}
+		}
+		if (!added) {
+			goto shutdown;
+		}
+		if (opts.reattach && strncmp(opts.devs[i], "hidraw", 6) == 0) {
+			log_fmt(ERROR, "--reattach needs a USB device\n");
+			goto shutdown;
+		}
+	}
+	for (i = 0; i < opts.nmirrors; ++i) {
+		session_add_mirror(&sessions[0], opts.mirrors[i]);
+	}
+	for (i = 0; i < nsessions; ++i) {
+		ninterfaces += session_hid_interfaces(&sessions[i]);
+	}
+	timing_mark(&timing, "read profile");
 
-	/* We want to exit cleanly in event of SIGINT or SIGHUP */
-	sigemptyset(&sa.sa_mask);
-	sa.sa_handler = hup;
-	sa.sa_flags = 0;
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGHUP, &sa, NULL);
-
-	snprintf(configfs, sizeof(configfs), "/sys/kernel/config/usb_gadget/%s", opts.name);
-	if (!create_configfs(configfs, syspath)) {
+	/* Every interface of every session in one table, so the forwarding
+	 * engines can treat them all alike */
+	interfaces = calloc(ninterfaces, sizeof(*interfaces));
+	if (!interfaces) {
+		log_errno(ERROR, "Failed to allocate interfaces");
 		goto shutdown;
 	}
 
-	for (i = 0; i < max_interfaces; ++i) {
-		int type = interface_type(syspath, bus_id, i);
-		hidg[i] = -1;
-		hidraw[i] = -1;
+	catch_hup();
 
-		is_hid[i] = type == 3;
-		if (!is_hid[i]) {
-			continue;
+	for (i = 0; i < nsessions; ++i) {
+		sessions[i].keep = opts.keep_gadget;
+		if (!session_create(&sessions[i], sessions, nsessions)) {
+			goto shutdown;
 		}
+	}
+	timing_mark(&timing, "create gadget");
 
-		snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/%s:1.%u", syspath, bus_id, i);
-		if (!create_configfs_function(configfs, syspath_tmp, i)) {
-			log_errno(ERROR, "Could not create function");
+	for (i = 0; i < nsessions; ++i) {
+		if (!session_open(&sessions[i], &interfaces[open_interfaces], &opts)) {
 			goto shutdown;
 		}
+		open_interfaces += sessions[i].count;
 	}
-
-	if (opts.udc) {
-		strncpy(udc, opts.udc, sizeof(udc) - 1);
-	} else if (!find_udc(udc)) {
-		log_errno(ERROR, "Could not find UDC");
+	if (opts.realtime) {
+		for (i = 0; i < open_interfaces; ++i) {
+			if (!forward_freeze(&interfaces[i])) {
+				goto shutdown;
+			}
+		}
+	}
+	if (opts.save_profile && !session_save_profile(&sessions[0], opts.save_profile)) {
 		goto shutdown;
 	}
+	if (opts.record) {
+		if (!capture_open(&capture, opts.record, &sessions[0].profile)) {
+			goto shutdown;
+		}
+		for (i = 0; i < open_interfaces; ++i) {
+			interfaces[i].capture = &capture;
+		}
+	}
+	timing_mark(&timing, "open devices");
 
-	if (!start_udc(configfs, udc)) {
+	if (did_hup || !loop_init(&loop)) {
 		goto shutdown;
 	}
-
-	for (i = 0, j = 0; i < max_interfaces; ++i) {
-		if (!is_hid[i]) {
-			continue;
-		}
-		snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/functions/hid.usb%u/dev", configfs, i);
-		hidg[j] = find_dev(syspath_tmp, "hidg");
-		ret = fcntl(hidg[j], F_GETFL, 0);
-		if (ret < 0) {
-			log_errno(ERROR, "Failed to get dev flags");
-			goto late_shutdown;
+	if (!stats_dump_init(&stats_dump, &loop, sessions, nsessions)) {
+		goto free_loop;
+	}
+	if (!feature_init(&feature_worker, &loop)) {
+		goto free_stats_dump;
+	}
+	for (i = 0; i < nsessions; ++i) {
+		if (!session_start_output(&sessions[i])) {
+			goto free_output;
 		}
-		fcntl(hidg[j], F_SETFL, ret | FNONBLOCK);
-		snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/%s:1.%u", syspath, bus_id, i);
-		hidraw[j] = find_hidraw(syspath_tmp);
-		if (hidg[j] < 0 || hidraw[j] < 0) {
-			for (i = 0; i < max_interfaces; ++i) {
-				if (hidg[i] >= 0) {
-					close(hidg[i]);
-				}
-				if (hidraw[i] >= 0) {
-					close(hidraw[i]);
-				}
+	}
+	if (opts.control && !control_init(&control, &loop, opts.control, sessions, nsessions)) {
+		goto free_output;
+	}
+	if (opts.realtime && !realtime_start(&realtime, &loop)) {
+		goto free_control;
+	}
+	timing_mark(&timing, "start loop");
+	timing_total(&timing);
+	if (opts.replay && !replay_start(&replay, &loop, &did_hup)) {
+		goto free_realtime;
+	}
+	if (opts.threads) {
+		ok = !run_threads(&loop, &feature_worker, interfaces, open_interfaces, &opts);
+		goto stop_replay;
+	}
+	if (opts.io_uring) {
+		if (uring_init(&ring, interfaces, open_interfaces, &loop)) {
+			for (i = 0; i < open_interfaces; ++i) {
+				interfaces[i].feature_worker = &feature_worker;
 			}
-			goto late_shutdown;
+			config = thread_config(&opts, 0);
+			thread_configure(&config);
+			ok = !uring_run(&ring, &did_hup);
+			uring_free(&ring);
+			goto stop_replay;
 		}
-		++j;
+		log_fmt(WARN, "Falling back to epoll\n");
 	}
-	max_interfaces = j;
-
-	if (did_hup) {
-		goto late_shutdown;
+	for (i = 0; i < open_interfaces; ++i) {
+		if (!forward_attach(&interfaces[i], &loop, &feature_worker)) {
+			goto stop_replay;
+		}
 	}
 
-	ok = !poll_fds(hidraw, hidg, max_interfaces);
+	if (opts.reattach) {
+		reattach.sessions = sessions;
+		reattach.count = nsessions;
+		if (!uevent_init(&reattach.monitor, &loop, reattach_uevent, &reattach)) {
+			goto stop_replay;
+		}
+	}
 
-	for (i = 0; i < max_interfaces; ++i) {
-		close(hidg[i]);
-		close(hidraw[i]);
+	config = thread_config(&opts, 0);
+	thread_configure(&config);
+	loop_busy_poll(&loop, config.busy_poll_ns, config.busy_poll_budget);
+	ok = !loop_run(&loop, &did_hup);
+	loop_log_stats(&loop);
+	if (opts.reattach) {
+		uevent_free(&reattach.monitor, &loop);
 	}
 
-late_shutdown:
-	stop_udc(configfs);
+stop_replay:
+	replay_stop(&replay);
+free_realtime:
+	if (opts.realtime) {
+		realtime_free(&realtime, &loop);
+	}
+free_control:
+	if (opts.control) {
+		control_free(&control);
+	}
+free_output:
+	for (i = 0; i < nsessions; ++i) {
+		session_stop_output(&sessions[i]);
+	}
+	feature_free(&feature_worker);
+free_stats_dump:
+	stats_dump_free(&stats_dump, &loop);
+free_loop:
+	loop_free(&loop);
 shutdown:
-	snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/strings/0x409", configfs);
-	rmdir(syspath_tmp);
-	snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/configs/c.1/strings/0x409", configfs);
-	rmdir(syspath_tmp);
-	for (i = 0; i < max_interfaces; ++i) {
-		snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/configs/c.1/hid.usb%u", configfs, i);
-		unlink(syspath_tmp);
-		snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/functions/hid.usb%u", configfs, i);
-		rmdir(syspath_tmp);
-	}
-	snprintf(syspath_tmp, sizeof(syspath_tmp), "%s/configs/c.1", configfs);
-	rmdir(syspath_tmp);
-	rmdir(configfs);
+	log_stats(sessions, nsessions);
+	for (i = 0; i < nsessions; ++i) {
+		session_free(&sessions[i]);
+	}
+	capture_close(&capture);
+	if (replay.capture) {
+		replay_free(&replay);
+	}
+	capture_close(&replay_capture);
+	free(interfaces);
+	free(sessions);
 early_shutdown:
+	log_stop();
 	getopt_free(&opts);
 	return ok;
 }
@@ -1,7 +1,11 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
+#include "feature.h"
 #include "log.h"
 #include "options.h"
+#include "realtime.h"
 
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,24 +13,189 @@
 
 static char* default_name = "passthru";
 
+static bool parse_device(const char* arg, struct Options* opts) {
+	const char* udc = strchr(arg, '@');
+	size_t size = udc ? (size_t) (udc - arg) : strlen(arg);
+
+	if (memchr(arg, '/', size)) {
+		log_fmt(ERROR, "Device name cannot include /\n");
+		return false;
+	}
+	if (!size || arg[0] == '.') {
+		log_fmt(ERROR, "Device name cannot be empty or start with .\n");
+		return false;
+	}
+	if (udc && (!udc[1] || strchr(&udc[1], '/'))) {
+		log_fmt(ERROR, "Invalid UDC in %s\n", arg);
+		return false;
+	}
+	opts->devs[opts->ndevs] = strndup(arg, size);
+	if (udc) {
+		opts->udcs[opts->ndevs] = strdup(&udc[1]);
+	}
+	++opts->ndevs;
+	return true;
+}
+
+static bool any_id(const bool* ids) {
+	int id;
+
+	for (id = 0; id < 256; ++id) {
+		if (ids[id]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Mirror hosts are only answered from static feature reports */
+static bool static_features(const struct Options* opts) {
+	int id;
+
+	if (opts->feature_policy == FEATURE_STATIC) {
+		return true;
+	}
+	for (id = 0; id < 256; ++id) {
+		if (opts->feature_policies[id] == FEATURE_STATIC) {
+			return true;
+		}
+	}
+	return false;
+}
+
 bool getopt_parse(int argc, char* argv[], struct Options* opts) {
-	static const char* flags = "hn:qu:v";
+	static const char* flags = "a:B:b:Cc:Ff:hj:kL:m:n:P:p:qRr:S:s:TtUu:vw:X";
 	static const struct option long_flags[] = {
+		{"affinity", required_argument, 0, 'a'},
+		{"busy-poll", required_argument, 0, 'b'},
+		{"busy-poll-budget", required_argument, 0, 'B'},
+		{"composite", no_argument, 0, 'C'},
+		{"control", required_argument, 0, 's'},
+		{"feature-cache", required_argument, 0, 'c'},
+		{"fifo", required_argument, 0, 'f'},
 		{"help", no_argument, 0, 'h'},
+		{"io-uring", no_argument, 0, 'U'},
+		{"jitter-test", required_argument, 0, 'j'},
+		{"keep-gadget", no_argument, 0, 'k'},
+		{"latest-output", required_argument, 0, 'L'},
+		{"mirror", required_argument, 0, 'm'},
 		{"name", required_argument, 0, 'n'},
+		{"priority", required_argument, 0, 'p'},
+		{"profile", required_argument, 0, 'P'},
 		{"quiet", no_argument, 0, 'q'},
+		{"realtime", no_argument, 0, 'X'},
+		{"reattach", no_argument, 0, 'R'},
+		{"record", required_argument, 0, 'w'},
+		{"replay", required_argument, 0, 'r'},
+		{"replay-fast", no_argument, 0, 'F'},
+		{"save-profile", required_argument, 0, 'S'},
+		{"threads", no_argument, 0, 't'},
+		{"timing", no_argument, 0, 'T'},
 		{"udc", required_argument, 0, 'u'},
 		{"verbose", no_argument, 0, 'v'},
 		{0}
 	};
 	int c;
+	unsigned long id;
+	char* end;
+	enum FeaturePolicy policy;
 	opts->name = default_name;
 
 	while ((c = getopt_long(argc, argv, flags, long_flags, NULL)) != -1) {
 		switch (c) {
+		case 'a':
+			end = optarg;
+			opts->ncpus = 0;
+			do {
+				char* start = end[0] == ',' ? &end[1] : end;
+				id = strtoul(start, &end, 10);
+				if (end == start || id >= CPU_SETSIZE || opts->ncpus == CPUS_MAX) {
+					log_fmt(ERROR, "Invalid CPU list %s\n", optarg);
+					return false;
+				}
+				opts->cpus[opts->ncpus++] = id;
+			} while (end[0] == ',');
+			if (end[0]) {
+				log_fmt(ERROR, "Invalid CPU list %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'B':
+			id = strtoul(optarg, &end, 10);
+			if (!optarg[0] || *end || id < 1 || id > 100) {
+				log_fmt(ERROR, "Invalid busy poll budget %s, must be between 1 and 100 percent\n", optarg);
+				return false;
+			}
+			opts->busy_poll_budget = id;
+			break;
+		case 'b':
+			id = strtoul(optarg, &end, 10);
+			if (!optarg[0] || *end || id < 1 || id > 100000) {
+				log_fmt(ERROR, "Invalid busy poll window %s, must be between 1 and 100000 us\n", optarg);
+				return false;
+			}
+			opts->busy_poll_us = id;
+			break;
+		case 'C':
+			opts->composite = true;
+			break;
+		case 'c':
+			end = strchr(optarg, '=');
+			if (!feature_policy_parse(end ? &end[1] : optarg, &policy)) {
+				log_fmt(ERROR, "Invalid feature cache policy %s\n", optarg);
+				return false;
+			}
+			if (!end) {
+				opts->feature_policy = policy;
+				break;
+			}
+			id = strtoul(optarg, &end, 0);
+			if (end == optarg || *end != '=' || id > 255) {
+				log_fmt(ERROR, "Invalid report ID %s\n", optarg);
+				return false;
+			}
+			opts->feature_policies[id] = policy;
+			break;
+		case 'F':
+			opts->replay_fast = true;
+			break;
+		case 'f':
+			id = strtoul(optarg, &end, 0);
+			if (!optarg[0] || *end || id > 255) {
+				log_fmt(ERROR, "Invalid report ID %s\n", optarg);
+				return false;
+			}
+			opts->fifo_ids[id] = true;
+			break;
 		case 'h':
 			opts->usage = true;
 			return true;
+		case 'j':
+			id = strtoul(optarg, &end, 10);
+			if (!optarg[0] || *end || id < 1 || id > 86400) {
+				log_fmt(ERROR, "Invalid jitter test length %s, must be between 1 and 86400 seconds\n", optarg);
+				return false;
+			}
+			opts->jitter_test = id;
+			break;
+		case 'k':
+			opts->keep_gadget = true;
+			break;
+		case 'L':
+			id = strtoul(optarg, &end, 0);
+			if (!optarg[0] || *end || id > 255) {
+				log_fmt(ERROR, "Invalid report ID %s\n", optarg);
+				return false;
+			}
+			opts->latest_ids[id] = true;
+			break;
+		case 'm':
+			if (opts->nmirrors == MIRRORS_MAX) {
+				log_fmt(ERROR, "At most %d mirrors are supported\n", MIRRORS_MAX);
+				return false;
+			}
+			opts->mirrors[opts->nmirrors++] = strdup(optarg);
+			break;
 		case 'n':
 			if (strchr(optarg, '/')) {
 				log_fmt(ERROR, "Passthru name cannot include /\n");
@@ -38,41 +207,196 @@ bool getopt_parse(int argc, char* argv[], struct Options* opts) {
 			}
 			opts->name = strdup(optarg);
 			break;
+		case 'P':
+			free(opts->profile);
+			opts->profile = strdup(optarg);
+			break;
+		case 'p':
+			id = strtoul(optarg, &end, 10);
+			if (!optarg[0] || *end || id < 1 || id > 99) {
+				log_fmt(ERROR, "Invalid priority %s, must be between 1 and 99\n", optarg);
+				return false;
+			}
+			opts->priority = id;
+			break;
 		case 'q':
 			set_log_level(ERROR);
 			break;
+		case 'R':
+			opts->reattach = true;
+			break;
+		case 'r':
+			free(opts->replay);
+			opts->replay = strdup(optarg);
+			break;
+		case 'S':
+			free(opts->save_profile);
+			opts->save_profile = strdup(optarg);
+			break;
+		case 's':
+			free(opts->control);
+			opts->control = strdup(optarg);
+			break;
+		case 'T':
+			opts->timing = true;
+			break;
+		case 't':
+			opts->threads = true;
+			break;
+		case 'U':
+			opts->io_uring = true;
+			break;
 		case 'u':
 			opts->udc = strdup(optarg);
 			break;
 		case 'v':
 			set_log_level(DEBUG);
 			break;
+		case 'w':
+			free(opts->record);
+			opts->record = strdup(optarg);
+			break;
+		case 'X':
+			opts->realtime = true;
+			break;
 		default:
 			return false;
 		}
 	}
 
+	if (opts->busy_poll_budget && !opts->busy_poll_us) {
+		log_fmt(ERROR, "--busy-poll-budget needs --busy-poll\n");
+		return false;
+	}
+	if (!opts->busy_poll_budget) {
+		opts->busy_poll_budget = BUSY_POLL_BUDGET;
+	}
+	if (opts->busy_poll_us && opts->io_uring) {
+		log_fmt(ERROR, "--busy-poll and --io-uring cannot be combined\n");
+		return false;
+	}
+	/* Locking memory would fault in the whole of the sparse capture file */
+	if (opts->realtime && opts->record) {
+		log_fmt(ERROR, "--record and --realtime cannot be combined\n");
+		return false;
+	}
+	if (opts->realtime && !opts->priority) {
+		opts->priority = REALTIME_PRIORITY;
+	}
+	if (opts->jitter_test) {
+		if (optind < argc || opts->replay) {
+			log_fmt(ERROR, "--jitter-test runs on its own, without a device\n");
+			return false;
+		}
+		return true;
+	}
+
+	/* The device is attached whenever it appears, and again after that */
+	if (opts->profile) {
+		opts->reattach = true;
+	}
+	if (opts->threads && opts->io_uring) {
+		log_fmt(ERROR, "--threads and --io-uring cannot be combined\n");
+		return false;
+	}
+	if (opts->nmirrors && !static_features(opts)) {
+		log_fmt(WARN, "No feature reports are static, so mirror hosts get zeroes for every feature report. "
+		        "Use --feature-cache static for those their drivers read\n");
+	}
+	/* io_uring streams block on the host instead of queueing reports */
+	if (opts->io_uring && (any_id(opts->fifo_ids) || any_id(opts->latest_ids))) {
+		log_fmt(ERROR, "--fifo and --latest-output do not work with --io-uring\n");
+		return false;
+	}
+	if (opts->nmirrors && opts->io_uring) {
+		log_fmt(ERROR, "--mirror and --io-uring cannot be combined\n");
+		return false;
+	}
+	if (opts->record && opts->io_uring) {
+		log_fmt(ERROR, "--record and --io-uring cannot be combined\n");
+		return false;
+	}
+	if (opts->reattach && (opts->threads || opts->io_uring)) {
+		log_fmt(ERROR, "--reattach and --profile only work with the default epoll loop\n");
+		return false;
+	}
+
+	if (opts->replay) {
+		if (optind < argc) {
+			log_fmt(ERROR, "--replay takes the place of a device\n");
+			return false;
+		}
+		if (opts->io_uring || opts->reattach || opts->composite) {
+			log_fmt(ERROR, "--replay cannot be combined with --io-uring, --reattach, --profile or --composite\n");
+			return false;
+		}
+		return true;
+	}
+	if (opts->replay_fast) {
+		log_fmt(ERROR, "--replay-fast needs --replay\n");
+		return false;
+	}
 	if (optind >= argc) {
 		puts("Missing device name");
 		return false;
 	}
-	if (strchr(argv[optind], '/')) {
-		log_fmt(ERROR, "Device name cannot include /\n");
+	opts->devs = calloc(argc - optind, sizeof(*opts->devs));
+	opts->udcs = calloc(argc - optind, sizeof(*opts->udcs));
+	if (!opts->devs || !opts->udcs) {
+		log_errno(ERROR, "Failed to allocate device list");
 		return false;
 	}
-	if (argv[optind][0] == '.') {
-		log_fmt(ERROR, "Device name cannot start with .\n");
+	for (; optind < argc; ++optind) {
+		if (!parse_device(argv[optind], opts)) {
+			return false;
+		}
+	}
+	if ((opts->profile || opts->save_profile) && (opts->ndevs > 1 || opts->composite)) {
+		log_fmt(ERROR, "--profile and --save-profile need a single device\n");
+		return false;
+	}
+	if (opts->profile && strncmp(opts->devs[0], "hidraw", 6) == 0) {
+		log_fmt(ERROR, "--profile needs a USB device, not a hidraw node\n");
 		return false;
 	}
-	opts->dev = strdup(argv[optind]);
+	if (opts->composite) {
+		for (c = 0; c < opts->ndevs; ++c) {
+			if (opts->udcs[c]) {
+				log_fmt(ERROR, "A composite gadget has a single UDC, use --udc instead\n");
+				return false;
+			}
+		}
+	} else if (opts->ndevs > 1) {
+		if (opts->udc) {
+			log_fmt(ERROR, "--udc only works with a single device, use DEVICE@UDC instead\n");
+			return false;
+		}
+		if (opts->nmirrors || opts->record) {
+			log_fmt(ERROR, "--mirror and --record only work with a single device or --composite\n");
+			return false;
+		}
+	}
 
 	return true;
 }
 
 void getopt_free(struct Options* opts) {
-	if (opts->dev) {
-		free(opts->dev);
+	int i;
+
+	for (i = 0; i < opts->ndevs; ++i) {
+		free(opts->devs[i]);
+		free(opts->udcs[i]);
+	}
+	free(opts->devs);
+	free(opts->udcs);
+	for (i = 0; i < opts->nmirrors; ++i) {
+		free(opts->mirrors[i]);
 	}
+	free(opts->record);
+	free(opts->replay);
+	free(opts->profile);
+	free(opts->save_profile);
+	free(opts->control);
 	if (opts->name != default_name) {
 		free(opts->name);
 	}
@@ -86,14 +410,83 @@ void usage(const char* argv0, bool help) {
 		puts("USB HID device passthrough");
 		puts("Copyright (c) 2022 Valve Software");
 	}
-	printf("Usage: %s [options] device\n", argv0);
+	printf("Usage: %s [options] device[@udc]...\n", argv0);
+	printf("       %s [options] --replay FILE\n", argv0);
+	printf("       %s [options] --jitter-test SECONDS\n", argv0);
 	puts("\nOptions:");
+	puts(" -a, --affinity CPUS");
+	puts("                    Pin forwarding to these comma separated CPUs, one per");
+	puts("                    interface thread with --threads");
+	puts(" -b, --busy-poll US Keep polling without sleeping for up to US microseconds after");
+	puts("                    each input report, until the next one is due, when the");
+	puts("                    device sends reports at least that often");
+	puts(" -B, --busy-poll-budget PERCENT");
+	puts("                    Share of the time busy polling may take up, 50 by default");
+	puts(" -C, --composite    Pass all devices through as a single gadget with the");
+	puts("                    interfaces of each, identified as the first device");
+	puts(" -c, --feature-cache [ID=]POLICY");
+	puts("                    Answer feature reports with this report ID (or all IDs) using");
+	puts("                    POLICY: forward (ask the device every time, the default),");
+	puts("                    static (read once at startup) or write-through (read once at");
+	puts("                    startup and replaced by what the host writes)");
+	puts(" -f, --fifo ID      Queue input reports with this report ID in order instead");
+	puts("                    of only keeping the latest one while the host is stalled");
 	puts(" -h, --help         Print out this help");
-	puts(" -n, --name NAME    Name of the passthru device, used in system paths");
+	puts(" -j, --jitter-test SECONDS");
+	puts("                    Instead of forwarding, measure how late the scheduler wakes");
+	puts("                    up a thread with the --priority and --affinity given, and");
+	puts("                    --realtime if given, to qualify a board and kernel");
+	puts(" -k, --keep-gadget  Leave the gadget bound on exit. The next run with the same");
+	puts("                    device takes it over, so the host does not see a restart");
+	puts(" -L, --latest-output ID");
+	puts("                    Only keep the latest output report with this report ID while");
+	puts("                    the device is busy, for reports such as rumble that replace");
+	puts("                    the one before");
+	puts(" -m, --mirror UDC   Also pass the input through to the host on this UDC. Output");
+	puts("                    and feature reports only come from the first host, the others");
+	puts("                    are answered from the static feature reports read at startup.");
+	puts("                    May be given up to 4 times");
+	puts(" -n, --name NAME    Name of the passthru device, used in system paths. With");
+	puts("                    several devices, each gadget gets the name with its index");
+	puts("                    appended");
+	puts(" -P, --profile FILE Build the gadget from a profile saved with --save-profile and");
+	puts("                    bind it right away, attaching the device whenever it appears.");
+	puts("                    Implies --reattach");
+	puts(" -p, --priority PRIO");
+	puts("                    Forward with SCHED_FIFO realtime priority PRIO (1-99)");
 	puts(" -q, --quiet        Print less output");
+	puts(" -R, --reattach     Keep the gadget bound when the device is unplugged and resume");
+	puts("                    forwarding as soon as it is plugged back in");
+	puts(" -r, --replay FILE  Drive the gadget from a capture made with --record instead");
+	puts("                    of a device, with the timing it was recorded with");
+	puts(" -F, --replay-fast  Replay as fast as the host takes the reports");
+	puts(" -S, --save-profile FILE");
+	puts("                    Save the profile of the device, with any cached feature");
+	puts("                    reports, for --profile");
+	puts(" -s, --control PATH Serve live statistics on this Unix socket: connect and send");
+	puts("                    \"metrics\" (or nothing) for Prometheus text, or \"stats\" for");
+	puts("                    the binary form described in control.h");
+	puts(" -t, --threads      Forward each interface on its own thread");
+	puts(" -T, --timing       Log how long each step of setting up the gadget took");
 	puts(" -u, --udc UDC      Select which USB device controller to use for the gadget");
+	puts("                    when passing through a single device");
+	puts(" -U, --io-uring     Forward reports with io_uring, falling back to epoll if it");
+	puts("                    is not available. Each report waits for the host to take it,");
+	puts("                    with no queueing or coalescing while it is stalled, so");
+	puts("                    --fifo and --latest-output do not apply");
 	puts(" -v, --verbose      Print more output");
+	puts(" -w, --record FILE  Write every report and feature transaction, with the device");
+	puts("                    profile, to a capture file");
+	puts(" -X, --realtime     Lock all memory and prefault the stack and heap, forward with");
+	puts("                    SCHED_FIFO priority 50 unless --priority is given, and warn");
+	puts("                    if the heap grows or pages are faulted in from disk after");
+	puts("                    startup. Cannot be combined with --record");
 	puts("\nThe device name may be either specified as a bus ID, as seen in "
 	     "/sys/bus/usb/devices, or a VID:PID combination, in which case the first device "
 	     "that matches that combination will be passed through.");
+	puts("\nA hidraw node name such as hidraw3 passes through that single HID device "
+	     "whatever bus it is on, including virtual devices created through /dev/uhid.");
+	puts("\nSeveral devices may be passed through at once, each as its own gadget. A "
+	     "device followed by @UDC is bound to that USB device controller, the others "
+	     "each get the first controller no other device is using.");
 }
@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "forward.h"
+#include "log.h"
+#include "output.h"
+#include "threads.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* How long the worker waits for a device that is not taking reports */
+#define OUTPUT_WAIT_MS 1000
+
+static void output_schedule(struct OutputWorker* worker, struct OutputQueue* queue) {
+	queue->next = NULL;
+	queue->scheduled = true;
+	if (worker->tail) {
+		worker->tail->next = queue;
+	} else {
+		worker->head = queue;
+	}
+	worker->tail = queue;
+	pthread_cond_signal(&worker->cond);
+}
+
+static uint8_t* entry_data(const struct OutputQueue* queue, unsigned entry) {
+	return &queue->data[entry * REPORT_SIZE_MAX];
+}
+
+/* The report a new one with this ID replaces, if any */
+static struct OutputEntry* output_waiting(struct OutputQueue* queue, uint8_t id) {
+	unsigned entry;
+	unsigned i;
+
+	if (queue->modes[id] != REPORT_LATEST) {
+		return NULL;
+	}
+	for (i = 0; i < queue->depth; ++i) {
+		entry = (queue->head + i) % OUTPUT_QUEUE_MAX;
+		if (queue->entries[entry].id == id) {
+			return &queue->entries[entry];
+		}
+	}
+	return NULL;
+}
+
+static struct OutputQueue* output_next(struct OutputWorker* worker) {
+	struct OutputQueue* queue = worker->head;
+
+	worker->head = queue->next;
+	if (!worker->head) {
+		worker->tail = NULL;
+	}
+	queue->scheduled = false;
+	return queue;
+}
+
+/* Runs on the worker thread without the lock held. The hidraw fd is
+ * non-blocking for the loop's sake, but the worker can afford to wait. */
+static bool output_write(struct Endpoint* hidraw, const uint8_t* data, size_t size) {
+	struct pollfd pfd = {
+		.fd = hidraw->source.fd,
+		.events = POLLOUT,
+	};
+	ssize_t ret;
+
+	while (true) {
+		ret = hidraw->ops->write(hidraw, data, size);
+		if (ret >= 0) {
+			if ((size_t) ret < size) {
+				log_fmt(WARN, "Truncated output report on interface %d\n", hidraw->iface->index);
+			}
+			return true;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN && poll(&pfd, 1, OUTPUT_WAIT_MS) > 0) {
+			continue;
+		}
+		log_errno(ERROR, "Failed to write output report");
+		return false;
+	}
+}
+
+static void* output_thread(void* arg) {
+	struct OutputWorker* worker = arg;
+	struct OutputQueue* queue;
+	const struct OutputEntry* entry;
+	size_t size;
+	uint64_t stamp;
+	uint64_t started;
+	uint64_t done;
+	uint64_t one = 1;
+	bool wake;
+	bool ok;
+
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		while (!worker->stop && !worker->head) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		if (worker->stop) {
+			break;
+		}
+		queue = output_next(worker);
+		if (!queue->depth) {
+			/* Discarded since it was scheduled */
+			continue;
+		}
+		entry = &queue->entries[queue->head];
+		size = entry->length;
+		stamp = entry->stamp;
+		memcpy(queue->buffer, entry_data(queue, queue->head), size);
+		queue->head = (queue->head + 1) % OUTPUT_QUEUE_MAX;
+		--queue->depth;
+		queue->writing = true;
+		wake = queue->full;
+		queue->full = false;
+		pthread_mutex_unlock(&worker->lock);
+
+		if (wake && write(queue->source.fd, &one, sizeof(one)) < 0) {
+			log_errno(ERROR, "Failed to signal output queue space");
+		}
+		started = now_ns();
+		ok = output_write(&queue->iface->hidraw, queue->buffer, size);
+		done = now_ns();
+
+		pthread_mutex_lock(&worker->lock);
+		queue->writing = false;
+		if (ok) {
+			counter_add(&queue->stats.written, 1);
+			hist_record(&queue->stats.device, done - started);
+			hist_record(&queue->stats.latency, done - stamp);
+		} else {
+			counter_add(&queue->stats.failed, 1);
+		}
+		/* Back of the line, so one busy interface does not starve the rest */
+		if (queue->depth) {
+			output_schedule(worker, queue);
+		}
+		pthread_cond_broadcast(&worker->idle);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+bool output_init(struct OutputWorker* worker) {
+	memset(worker, 0, sizeof(*worker));
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	pthread_cond_init(&worker->idle, NULL);
+
+	if (!thread_spawn(&worker->thread, output_thread, worker)) {
+		pthread_cond_destroy(&worker->idle);
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+		return false;
+	}
+	return true;
+}
+
+void output_free(struct OutputWorker* worker) {
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = true;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->idle);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+}
+
+bool output_queue_init(struct OutputQueue* queue, struct OutputWorker* worker, struct Interface* iface, const struct ReportQueue* like) {
+	memset(queue, 0, sizeof(*queue));
+	queue->iface = iface;
+	queue->numbered = iface->reports.numbered;
+	memcpy(queue->modes, like->modes, sizeof(queue->modes));
+	/* Any size the device might be sent, so nothing is allocated later */
+	queue->data = malloc(OUTPUT_QUEUE_MAX * REPORT_SIZE_MAX);
+	if (!queue->data) {
+		log_errno(ERROR, "Failed to allocate output queue");
+		return false;
+	}
+
+	queue->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->source.fd < 0) {
+		log_errno(ERROR, "Failed to create output eventfd");
+		free(queue->data);
+		queue->data = NULL;
+		return false;
+	}
+	queue->source.events = EPOLLIN;
+	queue->source.data = queue;
+	queue->worker = worker;
+	return true;
+}
+
+void output_queue_free(struct OutputQueue* queue) {
+	if (!queue->worker) {
+		return;
+	}
+	close(queue->source.fd);
+	free(queue->data);
+	queue->data = NULL;
+	queue->worker = NULL;
+}
+
+ssize_t output_push(struct OutputQueue* queue, const uint8_t* data, size_t size, uint64_t stamp) {
+	struct OutputWorker* worker = queue->worker;
+	uint8_t id = queue->numbered && size > 0 ? data[0] : 0;
+	struct OutputEntry* waiting;
+	unsigned entry;
+
+	pthread_mutex_lock(&worker->lock);
+	waiting = output_waiting(queue, id);
+	/* A full queue still takes reports that replace one waiting in it */
+	if (!waiting && queue->depth >= OUTPUT_QUEUE_MAX) {
+		queue->full = true;
+		pthread_mutex_unlock(&worker->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	if (waiting) {
+		entry = waiting - queue->entries;
+		counter_add(&queue->coalesced, 1);
+	} else {
+		entry = (queue->head + queue->depth) % OUTPUT_QUEUE_MAX;
+		++queue->depth;
+	}
+	memcpy(entry_data(queue, entry), data, size);
+	queue->entries[entry].stamp = stamp;
+	queue->entries[entry].length = size;
+	queue->entries[entry].id = id;
+	counter_add(&queue->stats.queued, 1);
+	counter_add(&queue->stats.depth_sum, queue->depth);
+	if (queue->depth > queue->stats.depth_max) {
+		counter_set(&queue->stats.depth_max, queue->depth);
+	}
+	if (!queue->scheduled && !queue->writing) {
+		output_schedule(worker, queue);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return size;
+}
+
+void output_discard(struct OutputQueue* queue) {
+	struct OutputWorker* worker = queue->worker;
+
+	pthread_mutex_lock(&worker->lock);
+	counter_add(&queue->stats.discarded, queue->depth);
+	queue->head = 0;
+	queue->depth = 0;
+	queue->full = false;
+	while (queue->writing) {
+		pthread_cond_wait(&worker->idle, &worker->lock);
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void output_log_stats(const struct OutputQueue* queue) {
+	const struct OutputStats* stats = &queue->stats;
+
+	if (!stats->queued) {
+		return;
+	}
+	log_fmt(INFO, "Interface %d output queue: %" PRIu64 " queued, %" PRIu64 " written, "
+	        "%" PRIu64 " failed, %" PRIu64 " discarded, %" PRIu64 " coalesced, "
+	        "depth avg %.1f max %" PRIu64 "\n",
+	        queue->iface->index, stats->queued, stats->written, stats->failed,
+	        stats->discarded, queue->coalesced,
+	        (double) stats->depth_sum / stats->queued, stats->depth_max);
+	hist_log(&stats->latency, "queued");
+	hist_log(&stats->device, "device");
+}
@@ -0,0 +1,532 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "log.h"
+#include "profile.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <unistd.h>
+
+/* Reads a sysfs attribute as a string without its trailing newline */
+static bool read_attr(int dirfd, const char* name, char* buf, size_t size) {
+	ssize_t len;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0) {
+		return false;
+	}
+	while (len > 0 && buf[len - 1] == '\n') {
+		--len;
+	}
+	buf[len] = '\0';
+	return true;
+}
+
+static bool read_number(int dirfd, const char* name, int base, unsigned long* value) {
+	char buf[32];
+	char* end;
+
+	if (!read_attr(dirfd, name, buf, sizeof(buf))) {
+		log_errno(ERROR, "Failed to read device property");
+		return false;
+	}
+	*value = strtoul(buf, &end, base);
+	if (end == buf) {
+		log_fmt(ERROR, "Invalid device property %s: %s\n", name, buf);
+		return false;
+	}
+	return true;
+}
+
+static bool read_hex8(int dirfd, const char* name, uint8_t* value) {
+	unsigned long tmp;
+
+	if (!read_number(dirfd, name, 16, &tmp)) {
+		return false;
+	}
+	*value = tmp;
+	return true;
+}
+
+static bool read_hex16(int dirfd, const char* name, uint16_t* value) {
+	unsigned long tmp;
+
+	if (!read_number(dirfd, name, 16, &tmp)) {
+		return false;
+	}
+	*value = tmp;
+	return true;
+}
+
+/* Strings are optional, plenty of devices do not have a serial number */
+static void read_string(int dirfd, const char* name, char* buf, size_t size) {
+	if (!read_attr(dirfd, name, buf, size)) {
+		buf[0] = '\0';
+	}
+}
+
+static bool read_descriptor(int dirfd, const char* name, struct InterfaceProfile* iface) {
+	ssize_t size;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open report descriptor input file");
+		return false;
+	}
+	size = read(fd, iface->descriptor, sizeof(iface->descriptor));
+	close(fd);
+	if (size <= 0) {
+		log_errno(ERROR, "Failed to read report descriptor file");
+		return false;
+	}
+	iface->descriptor_size = size;
+	return true;
+}
+
+/* "2.00" as USB spells it in sysfs, to 0x0200 */
+static bool read_bcd_usb(int dirfd, uint16_t* bcd) {
+	char buf[16];
+	unsigned major;
+	unsigned minor;
+
+	if (!read_attr(dirfd, "version", buf, sizeof(buf)) || sscanf(buf, " %u.%x", &major, &minor) != 2) {
+		log_fmt(ERROR, "Failed to read USB version\n");
+		return false;
+	}
+	*bcd = major << 8 | (minor & 0xFF);
+	return true;
+}
+
+static bool read_usb_interface(int parent, const char* bus_id, int index, struct InterfaceProfile* iface) {
+	char name[64];
+	struct dirent* dent;
+	uint8_t class;
+	DIR* dir;
+	int fd;
+	bool ok = false;
+
+	snprintf(name, sizeof(name), "%s:1.%u", bus_id, index);
+	fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open interface");
+		return false;
+	}
+	if (!read_hex8(fd, "bInterfaceClass", &class)) {
+		log_fmt(ERROR, "Could not determine interface class\n");
+		close(fd);
+		return false;
+	}
+	iface->hid = class == 3;
+	if (!iface->hid) {
+		close(fd);
+		return true;
+	}
+	if (!read_hex8(fd, "bInterfaceSubClass", &iface->subclass) ||
+	    !read_hex8(fd, "bInterfaceProtocol", &iface->protocol)) {
+		close(fd);
+		return false;
+	}
+
+	/* The HID device bound to the interface holds the descriptor */
+	dir = fdopendir(fd);
+	if (!dir) {
+		log_errno(ERROR, "Failed to opendir function");
+		close(fd);
+		return false;
+	}
+	while ((dent = readdir(dir))) {
+		if (dent->d_type == DT_DIR && strncmp(dent->d_name, "0003:", 5) == 0) {
+			break;
+		}
+	}
+	if (!dent) {
+		log_fmt(ERROR, "Failed to find function\n");
+	} else {
+		snprintf(name, sizeof(name), "%s/report_descriptor", dent->d_name);
+		ok = read_descriptor(dirfd(dir), name, iface);
+	}
+	closedir(dir);
+	return ok;
+}
+
+bool profile_read_usb(struct DeviceProfile* profile, const char* syspath, const char* bus_id) {
+	char buf[32];
+	unsigned long value;
+	int dirfd;
+	int i;
+	bool ok = false;
+
+	memset(profile, 0, sizeof(*profile));
+	dirfd = open(syspath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		log_errno(ERROR, "Failed to open device");
+		return false;
+	}
+
+	if (!read_hex16(dirfd, "idVendor", &profile->vendor_id) ||
+	    !read_hex16(dirfd, "idProduct", &profile->product_id) ||
+	    !read_hex16(dirfd, "bcdDevice", &profile->bcd_device) ||
+	    !read_hex8(dirfd, "bDeviceSubClass", &profile->device_subclass) ||
+	    !read_hex8(dirfd, "bDeviceProtocol", &profile->device_protocol) ||
+	    !read_bcd_usb(dirfd, &profile->bcd_usb)) {
+		goto done;
+	}
+
+	/* Comes with units, e.g. 500mA */
+	if (!read_attr(dirfd, "bMaxPower", buf, sizeof(buf))) {
+		log_errno(ERROR, "Failed to read max power file");
+		goto done;
+	}
+	profile->max_power = strtoul(buf, NULL, 10);
+
+	read_string(dirfd, "manufacturer", profile->manufacturer, sizeof(profile->manufacturer));
+	read_string(dirfd, "product", profile->product, sizeof(profile->product));
+	read_string(dirfd, "serial", profile->serial, sizeof(profile->serial));
+	read_string(dirfd, "configuration", profile->configuration, sizeof(profile->configuration));
+
+	if (!read_number(dirfd, "bNumInterfaces", 10, &value)) {
+		goto done;
+	}
+	profile->interfaces = value > INTERFACES_MAX ? INTERFACES_MAX : value;
+	for (i = 0; i < profile->interfaces; ++i) {
+		if (!read_usb_interface(dirfd, bus_id, i, &profile->interface[i])) {
+			goto done;
+		}
+	}
+	ok = true;
+
+done:
+	close(dirfd);
+	return ok;
+}
+
+/* A HID device on any other bus, such as one created through uhid, passed
+ * through as a single interface with the IDs it was created with */
+bool profile_read_hid(struct DeviceProfile* profile, const char* syspath) {
+	char line[256];
+	bool found = false;
+	unsigned bus;
+	unsigned vid;
+	unsigned pid;
+	FILE* file;
+	int dirfd;
+	int fd;
+
+	memset(profile, 0, sizeof(*profile));
+	dirfd = open(syspath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		log_errno(ERROR, "Failed to open HID device");
+		return false;
+	}
+	fd = openat(dirfd, "uevent", O_RDONLY | O_CLOEXEC);
+	file = fd < 0 ? NULL : fdopen(fd, "r");
+	if (!file) {
+		log_errno(ERROR, "Failed to open HID uevent");
+		if (fd >= 0) {
+			close(fd);
+		}
+		close(dirfd);
+		return false;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vid, &pid) == 3) {
+			found = true;
+		} else if (strncmp(line, "HID_NAME=", 9) == 0) {
+			snprintf(profile->product, sizeof(profile->product), "%s", &line[9]);
+		} else if (strncmp(line, "HID_UNIQ=", 9) == 0) {
+			snprintf(profile->serial, sizeof(profile->serial), "%s", &line[9]);
+		}
+	}
+	fclose(file);
+	if (!found) {
+		log_fmt(ERROR, "HID device has no IDs\n");
+		close(dirfd);
+		return false;
+	}
+
+	profile->vendor_id = vid;
+	profile->product_id = pid;
+	profile->bcd_usb = 0x0200;
+	profile->max_power = 100;
+	profile->interfaces = 1;
+	profile->interface[0].hid = true;
+	found = read_descriptor(dirfd, "report_descriptor", &profile->interface[0]);
+	close(dirfd);
+	return found;
+}
+
+bool profile_merge(struct DeviceProfile* composite, const struct DeviceProfile* source) {
+	int i;
+
+	if (!composite->interfaces) {
+		*composite = *source;
+		return true;
+	}
+	for (i = 0; i < source->interfaces; ++i) {
+		if (!source->interface[i].hid) {
+			continue;
+		}
+		if (composite->interfaces == INTERFACES_MAX) {
+			log_fmt(ERROR, "Composite gadget cannot have more than %d interfaces\n", INTERFACES_MAX);
+			return false;
+		}
+		composite->interface[composite->interfaces++] = source->interface[i];
+	}
+	/* Every device draws its power through the one port now, within what a
+	 * USB 2 port may supply */
+	composite->max_power += source->max_power;
+	if (composite->max_power > 500) {
+		composite->max_power = 500;
+	}
+	/* The functions say what they are, not the device */
+	composite->device_subclass = 0;
+	composite->device_protocol = 0;
+	return true;
+}
+
+#define PROFILE_MAGIC "HIDPROF1"
+
+/* Little-endian, sized to whatever the profile holds */
+struct ProfileBuffer {
+	uint8_t* data;
+	size_t size;
+	size_t pos;
+	bool overflow;
+};
+
+static void put_bytes(struct ProfileBuffer* buf, const void* data, size_t size) {
+	if (buf->pos + size > buf->size) {
+		buf->overflow = true;
+		return;
+	}
+	memcpy(&buf->data[buf->pos], data, size);
+	buf->pos += size;
+}
+
+static void put_u8(struct ProfileBuffer* buf, uint8_t value) {
+	put_bytes(buf, &value, 1);
+}
+
+static void put_u16(struct ProfileBuffer* buf, uint16_t value) {
+	put_u8(buf, value & 0xFF);
+	put_u8(buf, value >> 8);
+}
+
+static void put_string(struct ProfileBuffer* buf, const char* string) {
+	size_t size = strnlen(string, PROFILE_STRING_MAX - 1);
+
+	put_u8(buf, size);
+	put_bytes(buf, string, size);
+}
+
+static void get_bytes(struct ProfileBuffer* buf, void* data, size_t size) {
+	if (buf->pos + size > buf->size) {
+		buf->overflow = true;
+		memset(data, 0, size);
+		return;
+	}
+	memcpy(data, &buf->data[buf->pos], size);
+	buf->pos += size;
+}
+
+static uint8_t get_u8(struct ProfileBuffer* buf) {
+	uint8_t value;
+
+	get_bytes(buf, &value, 1);
+	return value;
+}
+
+static uint16_t get_u16(struct ProfileBuffer* buf) {
+	uint16_t value = get_u8(buf);
+
+	return value | get_u8(buf) << 8;
+}
+
+static void get_string(struct ProfileBuffer* buf, char* string) {
+	size_t size = get_u8(buf);
+
+	if (size >= PROFILE_STRING_MAX) {
+		buf->overflow = true;
+		size = 0;
+	}
+	get_bytes(buf, string, size);
+	string[size] = '\0';
+}
+
+bool profile_save(const char* path, const struct DeviceProfile* profile, const struct ProfileFeature* features, int count) {
+	struct ProfileBuffer buf = {0};
+	char tmp[PATH_MAX];
+	const struct InterfaceProfile* iface;
+	bool ok = false;
+	int fd;
+	int i;
+
+	buf.size = sizeof(*profile) + count * sizeof(*features) + 64;
+	buf.data = malloc(buf.size);
+	if (!buf.data) {
+		log_errno(ERROR, "Failed to allocate profile");
+		return false;
+	}
+	put_bytes(&buf, PROFILE_MAGIC, 8);
+	put_u16(&buf, profile->vendor_id);
+	put_u16(&buf, profile->product_id);
+	put_u16(&buf, profile->bcd_device);
+	put_u16(&buf, profile->bcd_usb);
+	put_u8(&buf, profile->device_subclass);
+	put_u8(&buf, profile->device_protocol);
+	put_u16(&buf, profile->max_power);
+	put_string(&buf, profile->manufacturer);
+	put_string(&buf, profile->product);
+	put_string(&buf, profile->serial);
+	put_string(&buf, profile->configuration);
+	put_u8(&buf, profile->interfaces);
+	for (i = 0; i < profile->interfaces; ++i) {
+		iface = &profile->interface[i];
+		put_u8(&buf, iface->hid);
+		put_u8(&buf, iface->subclass);
+		put_u8(&buf, iface->protocol);
+		put_u16(&buf, iface->descriptor_size);
+		put_bytes(&buf, iface->descriptor, iface->descriptor_size);
+	}
+	put_u16(&buf, count);
+	for (i = 0; i < count; ++i) {
+		put_u8(&buf, features[i].interface);
+		put_u8(&buf, features[i].length);
+		put_bytes(&buf, features[i].data, features[i].length);
+	}
+
+	/* Replaced in one go, so a profile is never seen half written */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to create profile");
+		goto done;
+	}
+	if (write(fd, buf.data, buf.pos) != (ssize_t) buf.pos || fsync(fd) < 0) {
+		log_errno(ERROR, "Failed to write profile");
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		log_errno(ERROR, "Failed to replace profile");
+		unlink(tmp);
+		goto done;
+	}
+	ok = true;
+
+done:
+	free(buf.data);
+	return ok;
+}
+
+bool profile_load(const char* path, struct DeviceProfile* profile, struct ProfileFeature** features, int* count) {
+	struct ProfileBuffer buf = {0};
+	struct InterfaceProfile* iface;
+	struct ProfileFeature* feature;
+	char magic[8];
+	ssize_t size;
+	int fd;
+	int i;
+
+	memset(profile, 0, sizeof(*profile));
+	*features = NULL;
+	*count = 0;
+	buf.size = sizeof(*profile) + INTERFACES_MAX * 256 * sizeof(**features);
+	buf.data = malloc(buf.size);
+	if (!buf.data) {
+		log_errno(ERROR, "Failed to allocate profile");
+		return false;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(ERROR, "Failed to open profile");
+		goto fail;
+	}
+	size = read(fd, buf.data, buf.size);
+	close(fd);
+	if (size < 0) {
+		log_errno(ERROR, "Failed to read profile");
+		goto fail;
+	}
+	buf.size = size;
+
+	get_bytes(&buf, magic, sizeof(magic));
+	if (memcmp(magic, PROFILE_MAGIC, sizeof(magic)) != 0) {
+		log_fmt(ERROR, "%s is not a profile\n", path);
+		goto fail;
+	}
+	profile->vendor_id = get_u16(&buf);
+	profile->product_id = get_u16(&buf);
+	profile->bcd_device = get_u16(&buf);
+	profile->bcd_usb = get_u16(&buf);
+	profile->device_subclass = get_u8(&buf);
+	profile->device_protocol = get_u8(&buf);
+	profile->max_power = get_u16(&buf);
+	get_string(&buf, profile->manufacturer);
+	get_string(&buf, profile->product);
+	get_string(&buf, profile->serial);
+	get_string(&buf, profile->configuration);
+	profile->interfaces = get_u8(&buf);
+	if (profile->interfaces > INTERFACES_MAX) {
+		goto corrupt;
+	}
+	for (i = 0; i < profile->interfaces; ++i) {
+		iface = &profile->interface[i];
+		iface->hid = get_u8(&buf);
+		iface->subclass = get_u8(&buf);
+		iface->protocol = get_u8(&buf);
+		iface->descriptor_size = get_u16(&buf);
+		if (iface->descriptor_size > sizeof(iface->descriptor)) {
+			goto corrupt;
+		}
+		get_bytes(&buf, iface->descriptor, iface->descriptor_size);
+	}
+	*count = get_u16(&buf);
+	if (buf.overflow || *count > INTERFACES_MAX * 256) {
+		goto corrupt;
+	}
+	if (*count) {
+		*features = calloc(*count, sizeof(**features));
+		if (!*features) {
+			log_errno(ERROR, "Failed to allocate features");
+			goto fail;
+		}
+	}
+	for (i = 0; i < *count; ++i) {
+		feature = &(*features)[i];
+		feature->interface = get_u8(&buf);
+		feature->length = get_u8(&buf);
+		if (feature->length > sizeof(feature->data)) {
+			goto corrupt;
+		}
+		get_bytes(&buf, feature->data, feature->length);
+	}
+	if (buf.overflow) {
+		goto corrupt;
+	}
+	free(buf.data);
+	return true;
+
+corrupt:
+	log_fmt(ERROR, "Profile %s is corrupt\n", path);
+fail:
+	free(*features);
+	*features = NULL;
+	*count = 0;
+	free(buf.data);
+	return false;
+}
@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "log.h"
+#include "queue.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void queue_init(struct ReportQueue* queue, bool numbered, enum ReportMode mode) {
+	memset(queue, 0, sizeof(*queue));
+	queue->numbered = numbered;
+	memset(queue->modes, mode, sizeof(queue->modes));
+}
+
+void queue_free(struct ReportQueue* queue) {
+	int i;
+
+	for (i = 0; i < REPORT_IDS; ++i) {
+		if (!queue->slots[i]) {
+			continue;
+		}
+		free(queue->slots[i]->data);
+		free(queue->slots[i]);
+		queue->slots[i] = NULL;
+	}
+	queue->head = NULL;
+	queue->tail = NULL;
+}
+
+static struct ReportSlot* slot_get(struct ReportQueue* queue, uint8_t id, size_t size) {
+	struct ReportSlot* slot = queue->slots[id];
+	size_t depth;
+	uint8_t* data;
+	int i;
+
+	if (!slot) {
+		slot = calloc(1, sizeof(*slot));
+		if (!slot) {
+			log_errno(ERROR, "Failed to allocate report slot");
+			return NULL;
+		}
+		slot->mode = queue->modes[id];
+		queue->slots[id] = slot;
+	}
+	if (size <= slot->stride) {
+		return slot;
+	}
+
+	/* Grow every staged entry to the new stride, keeping their positions */
+	depth = slot->mode == REPORT_FIFO ? REPORT_FIFO_DEPTH : 1;
+	data = malloc(depth * size);
+	if (!data) {
+		log_errno(ERROR, "Failed to allocate report slot");
+		return NULL;
+	}
+	for (i = 0; i < slot->count; ++i) {
+		int entry = (slot->head + i) % REPORT_FIFO_DEPTH;
+		memcpy(&data[entry * size], &slot->data[entry * slot->stride], slot->lengths[entry]);
+	}
+	free(slot->data);
+	slot->data = data;
+	slot->stride = size;
+	return slot;
+}
+
+bool queue_reserve(struct ReportQueue* queue, uint8_t id, size_t size) {
+	return !!slot_get(queue, id, size);
+}
+
+/* Only valid before any report with this ID has been queued */
+bool queue_set_mode(struct ReportQueue* queue, uint8_t id, enum ReportMode mode) {
+	struct ReportSlot* slot = queue->slots[id];
+	size_t stride;
+
+	queue->modes[id] = mode;
+	if (!slot || slot->mode == mode) {
+		return true;
+	}
+	/* The slot was reserved for the old mode; reallocate it for the new depth */
+	stride = slot->stride;
+	free(slot->data);
+	slot->data = NULL;
+	slot->stride = 0;
+	slot->mode = mode;
+	return queue_reserve(queue, id, stride);
+}
+
+bool queue_push(struct ReportQueue* queue, const uint8_t* data, size_t size, uint64_t stamp) {
+	uint8_t id = queue->numbered && size > 0 ? data[0] : 0;
+	struct ReportSlot* slot = queue->slots[id];
+	int entry;
+
+	if (queue->frozen && (!slot || size > slot->stride)) {
+		counter_add(&queue->dropped, 1);
+		return true;
+	}
+	slot = slot_get(queue, id, size);
+	if (!slot) {
+		return false;
+	}
+	if (slot->mode == REPORT_LATEST) {
+		if (slot->count) {
+			counter_add(&queue->coalesced, 1);
+		}
+		slot->head = 0;
+		slot->count = 1;
+		entry = 0;
+	} else {
+		if (slot->count == REPORT_FIFO_DEPTH) {
+			slot->head = (slot->head + 1) % REPORT_FIFO_DEPTH;
+			--slot->count;
+			counter_add(&queue->dropped, 1);
+		}
+		entry = (slot->head + slot->count) % REPORT_FIFO_DEPTH;
+		++slot->count;
+	}
+	memcpy(&slot->data[entry * slot->stride], data, size);
+	slot->lengths[entry] = size;
+	slot->stamps[entry] = stamp;
+
+	if (!slot->queued) {
+		slot->queued = true;
+		slot->next = NULL;
+		if (queue->tail) {
+			queue->tail->next = slot;
+		} else {
+			queue->head = slot;
+		}
+		queue->tail = slot;
+	}
+	return true;
+}
+
+const uint8_t* queue_peek(const struct ReportQueue* queue, size_t* size, uint64_t* stamp) {
+	const struct ReportSlot* slot = queue->head;
+
+	if (!slot) {
+		return NULL;
+	}
+	*size = slot->lengths[slot->head];
+	*stamp = slot->stamps[slot->head];
+	return &slot->data[slot->head * slot->stride];
+}
+
+void queue_pop(struct ReportQueue* queue) {
+	struct ReportSlot* slot = queue->head;
+
+	if (!slot) {
+		return;
+	}
+	slot->head = (slot->head + 1) % REPORT_FIFO_DEPTH;
+	--slot->count;
+
+	queue->head = slot->next;
+	if (!queue->head) {
+		queue->tail = NULL;
+	}
+	if (slot->count) {
+		/* Rotate so other report IDs are not starved by a deep FIFO */
+		slot->next = NULL;
+		if (queue->tail) {
+			queue->tail->next = slot;
+		} else {
+			queue->head = slot;
+		}
+		queue->tail = slot;
+	} else {
+		slot->queued = false;
+	}
+}
+
+void queue_freeze(struct ReportQueue* queue) {
+	queue->frozen = true;
+}
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "hist.h"
+#include "log.h"
+#include "realtime.h"
+#include "threads.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Stack the loop thread may grow into, faulted in up front */
+#define REALTIME_STACK_PREFAULT (512 * 1024)
+/* Free heap kept at hand for whatever is allocated after startup */
+#define REALTIME_HEAP_PREFAULT (1024 * 1024)
+/* The first check takes the baseline, the others compare against it */
+#define REALTIME_BASELINE_S 1
+#define REALTIME_CHECK_S 10
+
+static void __attribute__((noinline)) prefault_stack(void) {
+	volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += page) {
+		stack[i] = 0;
+	}
+}
+
+static bool prefault_heap(void) {
+	uint8_t* heap = malloc(REALTIME_HEAP_PREFAULT);
+
+	if (!heap) {
+		log_errno(ERROR, "Failed to allocate heap to prefault");
+		return false;
+	}
+	memset(heap, 0, REALTIME_HEAP_PREFAULT);
+	/* Stays in the heap, since it is never trimmed */
+	free(heap);
+	return true;
+}
+
+/* Only the main arena is counted, which is why realtime_prepare keeps every
+ * thread on it */
+static size_t heap_size(void) {
+	struct mallinfo2 info = mallinfo2();
+
+	return info.arena + info.hblkhd;
+}
+
+static void realtime_sample(uint64_t* major_faults, uint64_t* minor_faults, size_t* heap) {
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	*major_faults = usage.ru_majflt;
+	*minor_faults = usage.ru_minflt;
+	*heap = heap_size();
+}
+
+static bool realtime_check(struct LoopSource* source, uint32_t) {
+	struct Realtime* rt = source->data;
+	uint64_t expirations;
+	uint64_t major_faults;
+	uint64_t minor_faults;
+	size_t heap;
+
+	if (read(source->fd, &expirations, sizeof(expirations)) < 0) {
+		return errno == EAGAIN;
+	}
+	realtime_sample(&major_faults, &minor_faults, &heap);
+	if (!rt->baseline) {
+		rt->baseline = true;
+		rt->major_faults = major_faults;
+		rt->minor_faults = minor_faults;
+		rt->heap = heap;
+		rt->reported_faults = major_faults;
+		rt->reported_heap = heap;
+		return true;
+	}
+	if (major_faults > rt->reported_faults) {
+		log_fmt(WARN, "Realtime: %" PRIu64 " major page faults since startup\n", major_faults - rt->major_faults);
+		rt->reported_faults = major_faults;
+	}
+	if (heap > rt->reported_heap) {
+		log_fmt(WARN, "Realtime: heap grew by %zu bytes since startup\n", heap - rt->heap);
+		rt->reported_heap = heap;
+	}
+	return true;
+}
+
+void realtime_prepare(void) {
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_TRIM_THRESHOLD, -1);
+}
+
+bool realtime_lock(void) {
+	if (!prefault_heap()) {
+		return false;
+	}
+	/* Threads started from here on get their stacks locked as they are
+	 * mapped */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		log_errno(ERROR, "Failed to lock memory");
+		return false;
+	}
+	prefault_stack();
+	return true;
+}
+
+bool realtime_start(struct Realtime* rt, struct Loop* loop) {
+	struct itimerspec period = {
+		.it_value = {.tv_sec = REALTIME_BASELINE_S},
+		.it_interval = {.tv_sec = REALTIME_CHECK_S},
+	};
+
+	memset(rt, 0, sizeof(*rt));
+	if (!realtime_lock()) {
+		return false;
+	}
+
+	rt->source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (rt->source.fd < 0) {
+		log_errno(ERROR, "Failed to create realtime check timer");
+		goto unlock;
+	}
+	if (timerfd_settime(rt->source.fd, 0, &period, NULL) < 0) {
+		log_errno(ERROR, "Failed to arm realtime check timer");
+		goto close_timer;
+	}
+	rt->source.events = EPOLLIN;
+	rt->source.handler = realtime_check;
+	rt->source.data = rt;
+	if (!loop_add(loop, &rt->source)) {
+		goto close_timer;
+	}
+	log_fmt(DEBUG, "Memory locked, %zu bytes of heap\n", heap_size());
+	return true;
+
+close_timer:
+	close(rt->source.fd);
+unlock:
+	munlockall();
+	return false;
+}
+
+void realtime_free(struct Realtime* rt, struct Loop* loop) {
+	uint64_t major_faults;
+	uint64_t minor_faults;
+	size_t heap;
+
+	loop_del(loop, &rt->source);
+	close(rt->source.fd);
+	if (rt->baseline) {
+		realtime_sample(&major_faults, &minor_faults, &heap);
+		log_fmt(INFO, "Realtime: %" PRIu64 " major and %" PRIu64 " minor page faults, heap grew by %zu bytes "
+		        "after startup\n", major_faults - rt->major_faults, minor_faults - rt->minor_faults,
+		        heap > rt->heap ? heap - rt->heap : 0);
+	}
+	munlockall();
+}
+
+bool realtime_jitter_test(const struct ThreadConfig* config, unsigned seconds, unsigned interval_us, const bool* stop) {
+	static struct Hist latency;
+	struct timespec next;
+	uint64_t interval = interval_us * 1000ULL;
+	uint64_t due;
+	uint64_t woke;
+	uint64_t end;
+	uint64_t overruns = 0;
+	int ret;
+
+	memset(&latency, 0, sizeof(latency));
+	if (!thread_configure(config)) {
+		return false;
+	}
+	log_fmt(INFO, "Jitter test: waking every %u us for %u s\n", interval_us, seconds);
+
+	due = now_ns() + interval;
+	end = due + seconds * 1000000000ULL;
+	while (due < end && !*stop) {
+		next.tv_sec = due / 1000000000ULL;
+		next.tv_nsec = due % 1000000000ULL;
+		ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		if (ret == EINTR) {
+			continue;
+		}
+		if (ret != 0) {
+			errno = ret;
+			log_errno(ERROR, "Failed to sleep");
+			return false;
+		}
+		woke = now_ns();
+		hist_record(&latency, woke - due);
+		/* Wakeups missed altogether are counted rather than made up for */
+		due += interval;
+		while (due <= woke) {
+			due += interval;
+			++overruns;
+		}
+	}
+	log_fmt(INFO, "Jitter test: %" PRIu64 " overruns\n", overruns);
+	hist_log(&latency, "wakeup latency");
+	return true;
+}
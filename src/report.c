@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "log.h"
+#include "report.h"
+
+#include <string.h>
+
+#define REPORT_STACK_MAX 8
+#define REPORT_BITS_MAX (UINT16_MAX * 8)
+
+enum ItemType {
+	ITEM_MAIN = 0,
+	ITEM_GLOBAL = 1,
+	ITEM_LOCAL = 2,
+};
+
+enum ItemTag {
+	MAIN_INPUT = 0x8,
+	MAIN_OUTPUT = 0x9,
+	MAIN_FEATURE = 0xB,
+	GLOBAL_REPORT_SIZE = 0x7,
+	GLOBAL_REPORT_ID = 0x8,
+	GLOBAL_REPORT_COUNT = 0x9,
+	GLOBAL_PUSH = 0xA,
+	GLOBAL_POP = 0xB,
+};
+
+struct GlobalState {
+	uint32_t report_size;
+	uint32_t report_count;
+	uint8_t report_id;
+};
+
+static struct ReportInfo* report_get(struct ReportTable* table, uint8_t id) {
+	struct ReportInfo* info;
+
+	if (table->index[id]) {
+		return &table->reports[table->index[id] - 1];
+	}
+	info = &table->reports[table->count];
+	info->id = id;
+	++table->count;
+	table->index[id] = table->count;
+	return info;
+}
+
+bool report_parse(struct ReportTable* table, const uint8_t* desc, size_t size) {
+	struct GlobalState stack[REPORT_STACK_MAX];
+	struct GlobalState global = {0};
+	uint32_t bits[256][REPORT_TYPES] = {{0}};
+	uint64_t item;
+	int depth = 0;
+	size_t i;
+	int j;
+
+	memset(table, 0, sizeof(*table));
+
+	for (i = 0; i < size; ) {
+		uint8_t prefix = desc[i];
+		uint32_t value = 0;
+		size_t len = prefix & 0x3;
+		enum ReportType type;
+
+		if (prefix == 0xFE) {
+			/* Long items carry no report layout; skip the size, tag and data */
+			if (i + 1 >= size) {
+				break;
+			}
+			i += desc[i + 1] + 3;
+			continue;
+		}
+		if (len == 3) {
+			len = 4;
+		}
+		if (i + 1 + len > size) {
+			log_fmt(ERROR, "Report descriptor truncated at offset %zu\n", i);
+			return false;
+		}
+		for (j = len - 1; j >= 0; --j) {
+			value = (value << 8) | desc[i + 1 + j];
+		}
+		i += 1 + len;
+
+		switch ((prefix >> 2) & 0x3) {
+		case ITEM_GLOBAL:
+			switch (prefix >> 4) {
+			case GLOBAL_REPORT_SIZE:
+				global.report_size = value;
+				break;
+			case GLOBAL_REPORT_COUNT:
+				global.report_count = value;
+				break;
+			case GLOBAL_REPORT_ID:
+				if (value == 0 || value > 255) {
+					log_fmt(ERROR, "Invalid report ID %u in report descriptor\n", value);
+					return false;
+				}
+				global.report_id = value;
+				table->numbered = true;
+				break;
+			case GLOBAL_PUSH:
+				if (depth == REPORT_STACK_MAX) {
+					log_fmt(ERROR, "Report descriptor pushes too deep\n");
+					return false;
+				}
+				stack[depth++] = global;
+				break;
+			case GLOBAL_POP:
+				if (depth == 0) {
+					log_fmt(ERROR, "Report descriptor pops empty stack\n");
+					return false;
+				}
+				global = stack[--depth];
+				break;
+			}
+			break;
+		case ITEM_MAIN:
+			switch (prefix >> 4) {
+			case MAIN_INPUT:
+				type = REPORT_INPUT;
+				break;
+			case MAIN_OUTPUT:
+				type = REPORT_OUTPUT;
+				break;
+			case MAIN_FEATURE:
+				type = REPORT_FEATURE;
+				break;
+			default:
+				continue;
+			}
+			/* Both come straight from the descriptor, so the product can
+			 * overflow 32 bits */
+			item = (uint64_t) global.report_size * global.report_count;
+			if (item > REPORT_BITS_MAX - bits[global.report_id][type]) {
+				log_fmt(ERROR, "Report %u is too large\n", global.report_id);
+				return false;
+			}
+			bits[global.report_id][type] += item;
+			report_get(table, global.report_id);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (table->numbered && table->index[0]) {
+		log_fmt(ERROR, "Report descriptor mixes numbered and unnumbered reports\n");
+		return false;
+	}
+	for (j = 0; j < table->count; ++j) {
+		struct ReportInfo* info = &table->reports[j];
+		int t;
+		for (t = 0; t < REPORT_TYPES; ++t) {
+			info->size[t] = (bits[info->id][t] + 7) / 8;
+		}
+	}
+	return true;
+}
+
+/* Size of the report on the wire, including the report ID if there is one */
+size_t report_size(const struct ReportTable* table, enum ReportType type, uint8_t id) {
+	const struct ReportInfo* info;
+
+	if (!table->index[id]) {
+		return 0;
+	}
+	info = &table->reports[table->index[id] - 1];
+	if (!info->size[type]) {
+		return 0;
+	}
+	return info->size[type] + table->numbered;
+}
+
+size_t report_max_size(const struct ReportTable* table, enum ReportType type) {
+	size_t max = 0;
+	int i;
+
+	for (i = 0; i < table->count; ++i) {
+		size_t size = report_size(table, type, table->reports[i].id);
+		if (size > max) {
+			max = size;
+		}
+	}
+	return max;
+}
+
+bool report_valid(const struct ReportTable* table, enum ReportType type, const uint8_t* data, size_t size) {
+	uint8_t id = table->numbered && size > 0 ? data[0] : 0;
+
+	/* Without a usable descriptor there is nothing to check against */
+	if (!table->count) {
+		return size > 0;
+	}
+	return size > 0 && report_size(table, type, id) == size;
+}
@@ -0,0 +1,497 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "session.h"
+#include "capture.h"
+#include "dev.h"
+#include "gadget.h"
+#include "log.h"
+#include "usb.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void gadget_init(struct SessionGadget* gadget, const char* name, const char* udc) {
+	snprintf(gadget->name, sizeof(gadget->name), "%s", name);
+	if (udc) {
+		strncpy(gadget->udc, udc, sizeof(gadget->udc) - 1);
+	}
+	snprintf(gadget->configfs, sizeof(gadget->configfs), "/sys/kernel/config/usb_gadget/%s", name);
+}
+
+void session_init(struct Session* session, const char* name, const char* udc) {
+	memset(session, 0, sizeof(*session));
+	gadget_init(&session->gadget[0], name, udc);
+	session->ngadgets = 1;
+}
+
+void session_replay(struct Session* session, struct Replay* replay) {
+	session->replay = replay;
+	session->profile = replay->capture->header->profile;
+}
+
+void session_add_mirror(struct Session* session, const char* udc) {
+	char name[NAME_MAX + 1];
+
+	snprintf(name, sizeof(name), "%s-mirror%d", session->gadget[0].name, session->ngadgets);
+	gadget_init(&session->gadget[session->ngadgets++], name, udc);
+}
+
+bool session_add_source(struct Session* session, const char* dev, const struct DeviceProfile* known) {
+	static struct DeviceProfile profile;
+	struct SessionSource* sources;
+	struct SessionSource* source;
+	int first = session->profile.interfaces;
+	int i;
+
+	sources = realloc(session->sources, (session->nsources + 1) * sizeof(*sources));
+	if (!sources) {
+		log_errno(ERROR, "Failed to allocate sources");
+		return false;
+	}
+	session->sources = sources;
+	source = &sources[session->nsources];
+	memset(source, 0, sizeof(*source));
+	source->dev = dev;
+
+	source->hid_source = strncmp(dev, "hidraw", 6) == 0;
+	if (known) {
+		profile = *known;
+		source->offline = true;
+		if (!find_sysfs_path(dev, source->syspath, source->bus_id)) {
+			log_fmt(INFO, "Waiting for %s to be plugged in\n", dev);
+			source->syspath[0] = '\0';
+		}
+	} else if (source->hid_source) {
+		if (!find_hid_sysfs_path(dev, source->syspath) || !profile_read_hid(&profile, source->syspath)) {
+			return false;
+		}
+	} else {
+		if (!find_sysfs_path(dev, source->syspath, source->bus_id) ||
+		    !profile_read_usb(&profile, source->syspath, source->bus_id)) {
+			return false;
+		}
+	}
+	for (i = 0; i < profile.interfaces && !profile.interface[i].hid; ++i);
+	if (i == profile.interfaces) {
+		log_fmt(ERROR, "Device %s has no HID interfaces\n", dev);
+		return false;
+	}
+	if (!profile_merge(&session->profile, &profile)) {
+		return false;
+	}
+
+	/* The first source keeps its interface numbers, the others are packed
+	 * after it in the same order profile_merge appends them */
+	for (i = 0; i < profile.interfaces; ++i) {
+		if (!first) {
+			session->route[i].source = session->nsources;
+			session->route[i].number = i;
+		} else if (profile.interface[i].hid) {
+			session->route[first].source = session->nsources;
+			session->route[first].number = i;
+			++first;
+		}
+	}
+	++session->nsources;
+	return true;
+}
+
+bool session_load_profile(struct Session* session, const char* dev, const char* path) {
+	static struct DeviceProfile profile;
+
+	if (!profile_load(path, &profile, &session->features, &session->nfeatures)) {
+		return false;
+	}
+	return session_add_source(session, dev, &profile);
+}
+
+bool session_save_profile(const struct Session* session, const char* path) {
+	const struct FeatureCache* cache;
+	struct ProfileFeature* features;
+	struct ProfileFeature* feature;
+	int count = 0;
+	bool ok;
+	int i, j;
+
+	for (i = 0; i < session->count; ++i) {
+		count += session->interfaces[i].reports.count;
+	}
+	features = calloc(count ? count : 1, sizeof(*features));
+	if (!features) {
+		log_errno(ERROR, "Failed to allocate features");
+		return false;
+	}
+	/* Whatever the caches hold, which is nothing under the forward policy */
+	count = 0;
+	for (i = 0; i < session->count; ++i) {
+		cache = &session->interfaces[i].feature_cache;
+		for (j = 0; cache->entries && j < cache->reports->count; ++j) {
+			if (!cache->entries[j].valid || cache->entries[j].length > PROFILE_FEATURE_SIZE_MAX) {
+				continue;
+			}
+			feature = &features[count++];
+			feature->interface = session->interfaces[i].index;
+			feature->length = cache->entries[j].length;
+			memcpy(feature->data, cache->entries[j].data, feature->length);
+		}
+	}
+	ok = profile_save(path, &session->profile, features, count);
+	if (ok) {
+		log_fmt(INFO, "Saved profile to %s with %d feature reports\n", path, count);
+	}
+	free(features);
+	return ok;
+}
+
+int session_hid_interfaces(const struct Session* session) {
+	int count = 0;
+	int i;
+
+	for (i = 0; i < session->profile.interfaces; ++i) {
+		count += session->profile.interface[i].hid;
+	}
+	return count;
+}
+
+/* UDCs already claimed by the other sessions of this process */
+struct UdcClaims {
+	const struct Session* sessions;
+	int count;
+};
+
+static bool udc_taken(void* data, const char* udc) {
+	const struct UdcClaims* claims = data;
+	const struct SessionGadget* gadget;
+	char bound[PATH_MAX];
+	int i, j;
+
+	for (i = 0; i < claims->count; ++i) {
+		for (j = 0; j < claims->sessions[i].ngadgets; ++j) {
+			gadget = &claims->sessions[i].gadget[j];
+			if (strcmp(gadget->udc, udc) == 0) {
+				return true;
+			}
+			/* Left bound by an earlier run, to be taken over */
+			if (gadget_udc(gadget->configfs, bound) && strcmp(bound, udc) == 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static bool session_gadget_create(struct Session* session, struct SessionGadget* gadget, const struct UdcClaims* claims) {
+	char bound[PATH_MAX];
+	bool was_bound = gadget_udc(gadget->configfs, bound);
+
+	/* Anything left over from an earlier run gets torn down with it */
+	gadget->created = true;
+	if (gadget_matches(gadget->configfs, &session->profile)) {
+		gadget_adopt(&session->profile, session->reports);
+		if (was_bound && (!gadget->udc[0] || strcmp(gadget->udc, bound) == 0)) {
+			snprintf(gadget->udc, sizeof(gadget->udc), "%s", bound);
+			gadget->bound = true;
+			log_fmt(INFO, "Taking over %s, still bound to %s\n", gadget->name, gadget->udc);
+			return true;
+		}
+		if (was_bound && !stop_udc(gadget->configfs)) {
+			return false;
+		}
+	} else {
+		/* A bound gadget cannot be changed, and one built for another
+		 * device may have functions this one does not */
+		if (was_bound && !stop_udc(gadget->configfs)) {
+			return false;
+		}
+		gadget_remove(gadget->configfs, INTERFACES_MAX);
+		if (!gadget_create(gadget->configfs, &session->profile, session->reports)) {
+			return false;
+		}
+	}
+
+	if (!gadget->udc[0] && !find_udc(gadget->udc, udc_taken, (void*) claims)) {
+		log_fmt(ERROR, "Could not find a free UDC for %s\n", gadget->name);
+		return false;
+	}
+	if (!start_udc(gadget->configfs, gadget->udc)) {
+		gadget->udc[0] = '\0';
+		return false;
+	}
+	gadget->bound = true;
+	log_fmt(DEBUG, "Bound %s to %s\n", gadget->name, gadget->udc);
+	return true;
+}
+
+bool session_create(struct Session* session, const struct Session* sessions, int count) {
+	struct UdcClaims claims = {
+		.sessions = sessions,
+		.count = count,
+	};
+	int i;
+
+	session->reports = calloc(session->profile.interfaces, sizeof(*session->reports));
+	if (!session->reports) {
+		log_errno(ERROR, "Failed to allocate report tables");
+		return false;
+	}
+	for (i = 0; i < session->ngadgets; ++i) {
+		if (!session_gadget_create(session, &session->gadget[i], &claims)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int open_hidg(const struct SessionGadget* gadget, int index) {
+	char path[PATH_MAX];
+	int hidg;
+
+	snprintf(path, sizeof(path), "%s/functions/hid.usb%u/dev", gadget->configfs, index);
+	hidg = find_dev(path, "hidg");
+	if (hidg >= 0 && !set_nonblock(hidg)) {
+		close(hidg);
+		return -1;
+	}
+	return hidg;
+}
+
+static int open_hidraw(struct Session* session, int index) {
+	const struct InterfaceRoute* route = &session->route[index];
+	const struct SessionSource* source;
+	char path[PATH_MAX];
+
+	if (session->replay) {
+		return replay_socket(session->replay, index);
+	}
+	source = &session->sources[route->source];
+	if (!source->syspath[0]) {
+		return -1;
+	}
+	if (source->hid_source) {
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/dev", source->dev);
+		return find_dev(path, "hidraw");
+	}
+	snprintf(path, sizeof(path), "%s/%s:1.%u", source->syspath, source->bus_id, route->number);
+	return find_hidraw(path);
+}
+
+bool session_open(struct Session* session, struct Interface* interfaces, const struct Options* opts) {
+	enum FeaturePolicy policy = opts->feature_policy;
+	struct Interface* iface;
+	bool pending;
+	int mirrors[MIRRORS_MAX];
+	int hidg;
+	int hidraw;
+	bool ret;
+	int i, j;
+
+	/* A capture can only answer with what it saw */
+	if (session->replay && policy == FEATURE_DEFAULT) {
+		policy = FEATURE_STATIC;
+	}
+	session->interfaces = interfaces;
+	for (i = 0; i < session->profile.interfaces; ++i) {
+		if (!session->profile.interface[i].hid) {
+			continue;
+		}
+		hidg = open_hidg(&session->gadget[0], i);
+		hidraw = open_hidraw(session, i);
+		/* A device known from its profile is attached once it appears */
+		pending = hidraw < 0 && !session->replay && session->sources[session->route[i].source].offline;
+		if (hidg < 0 || (hidraw < 0 && !pending) || (hidraw >= 0 && !set_nonblock(hidraw))) {
+			if (hidg >= 0) {
+				close(hidg);
+			}
+			if (hidraw >= 0) {
+				close(hidraw);
+			}
+			return false;
+		}
+		iface = &session->interfaces[session->count++];
+		ret = forward_init(iface, i, hidraw, hidg, &session->reports[i]);
+		iface->reattach = opts->reattach;
+		for (j = 0; ret && j < 256; ++j) {
+			if (opts->fifo_ids[j]) {
+				ret = queue_set_mode(&iface->input.queue, j, REPORT_FIFO);
+			}
+			if (ret && opts->latest_ids[j]) {
+				ret = queue_set_mode(&iface->output.queue, j, REPORT_LATEST);
+			}
+		}
+		if (!ret || !feature_cache_init(&iface->feature_cache, &iface->reports, opts->feature_policies, policy)) {
+			return false;
+		}
+		for (j = 0; j < session->nfeatures; ++j) {
+			if (session->features[j].interface == i) {
+				feature_cache_store(&iface->feature_cache, session->features[j].data, session->features[j].length);
+			}
+		}
+		if (session->replay) {
+			iface->hidraw.ops = &socket_ops;
+			replay_prime_features(session->replay, iface);
+		} else if (!pending) {
+			feature_cache_prefetch(&iface->feature_cache, &iface->hidraw);
+		}
+
+		for (j = 1; j < session->ngadgets; ++j) {
+			mirrors[j - 1] = open_hidg(&session->gadget[j], i);
+			if (mirrors[j - 1] < 0) {
+				while (--j > 0) {
+					close(mirrors[j - 1]);
+				}
+				return false;
+			}
+		}
+		if (session->ngadgets > 1 && !forward_init_mirrors(iface, mirrors, session->ngadgets - 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool source_detached(const struct Session* session, int source) {
+	int i;
+
+	for (i = 0; i < session->count; ++i) {
+		if (session->interfaces[i].detached && session->route[session->interfaces[i].index].source == source) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Hands interfaces whose device was unplugged their new hidraw node once it
+ * is back */
+static bool source_reattach(struct Session* session, int source, const struct Uevent* event) {
+	char syspath[PATH_MAX];
+	char prefix[PATH_MAX];
+	char bus_id[32];
+	const struct InterfaceRoute* route;
+	struct Interface* iface;
+	int hidraw;
+	int i;
+
+	/* The device may be back on another port, so look it up again */
+	if (!find_sysfs_path(session->sources[source].dev, syspath, bus_id)) {
+		return true;
+	}
+	for (i = 0; i < session->count; ++i) {
+		iface = &session->interfaces[i];
+		route = &session->route[iface->index];
+		if (!iface->detached || route->source != source) {
+			continue;
+		}
+		/* Uevent paths are relative to /sys */
+		snprintf(prefix, sizeof(prefix), "%s/%s:1.%u/", &syspath[4], bus_id, route->number);
+		if (strncmp(event->devpath, prefix, strlen(prefix)) != 0) {
+			continue;
+		}
+		snprintf(prefix, sizeof(prefix), "%s/%s:1.%u", syspath, bus_id, route->number);
+		hidraw = find_hidraw(prefix);
+		if (hidraw < 0) {
+			continue;
+		}
+		if (!set_nonblock(hidraw)) {
+			close(hidraw);
+			continue;
+		}
+		if (!forward_reattach(iface, hidraw)) {
+			close(hidraw);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool session_start_output(struct Session* session) {
+	int workers = session->nsources > 0 ? session->nsources : 1;
+	struct Interface* iface;
+	int i;
+
+	session->outputs = calloc(workers, sizeof(*session->outputs));
+	if (!session->outputs) {
+		log_errno(ERROR, "Failed to allocate output workers");
+		return false;
+	}
+	for (; session->noutputs < workers; ++session->noutputs) {
+		if (!output_init(&session->outputs[session->noutputs])) {
+			return false;
+		}
+	}
+	for (i = 0; i < session->count; ++i) {
+		iface = &session->interfaces[i];
+		if (!forward_dispatch_output(iface, &session->outputs[session->replay ? 0 : session->route[iface->index].source])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void session_stop_output(struct Session* session) {
+	int i;
+
+	for (i = 0; i < session->noutputs; ++i) {
+		output_free(&session->outputs[i]);
+	}
+	free(session->outputs);
+	session->outputs = NULL;
+	session->noutputs = 0;
+}
+
+bool session_reattach(struct Session* session, const struct Uevent* event) {
+	int i;
+
+	for (i = 0; i < session->nsources; ++i) {
+		if (session->sources[i].hid_source || !source_detached(session, i)) {
+			continue;
+		}
+		if (!source_reattach(session, i, event)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void session_log_stats(const struct Session* session) {
+	int i;
+
+	log_fmt(INFO, "Gadget %s on %s, from", session->gadget[0].name, session->gadget[0].udc);
+	if (session->replay) {
+		log_fmt(INFO, " a capture");
+	}
+	for (i = 0; i < session->nsources; ++i) {
+		log_fmt(INFO, " %s", session->sources[i].dev);
+	}
+	log_fmt(INFO, "\n");
+	for (i = 1; i < session->ngadgets; ++i) {
+		log_fmt(INFO, "Mirror %d: %s on %s\n", i, session->gadget[i].name, session->gadget[i].udc);
+	}
+	for (i = 0; i < session->count; ++i) {
+		forward_log_stats(&session->interfaces[i]);
+	}
+}
+
+void session_free(struct Session* session) {
+	int i;
+
+	for (i = 0; i < session->count; ++i) {
+		forward_close(&session->interfaces[i]);
+	}
+	for (i = 0; i < session->ngadgets; ++i) {
+		if (session->keep && session->gadget[i].bound) {
+			log_fmt(INFO, "Leaving %s bound to %s\n", session->gadget[i].name, session->gadget[i].udc);
+			continue;
+		}
+		if (session->gadget[i].bound) {
+			stop_udc(session->gadget[i].configfs);
+		}
+		if (session->gadget[i].created) {
+			gadget_remove(session->gadget[i].configfs, session->profile.interfaces);
+		}
+	}
+	free(session->reports);
+	free(session->sources);
+	free(session->features);
+}
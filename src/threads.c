@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
+#include "forward.h"
+#include "log.h"
+#include "threads.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+bool thread_configure(const struct ThreadConfig* config) {
+	struct sched_param param = {0};
+	cpu_set_t cpus;
+	int ret;
+
+	if (config->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (ret != 0) {
+			errno = ret;
+			log_errno(WARN, "Failed to set CPU affinity");
+			return false;
+		}
+	}
+	if (config->priority > 0) {
+		param.sched_priority = config->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0) {
+			errno = ret;
+			log_errno(WARN, "Failed to set realtime priority");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Signals must keep interrupting the main loop, so helper threads block them */
+bool thread_spawn(pthread_t* thread, void* (*fn)(void*), void* arg) {
+	sigset_t mask;
+	sigset_t old;
+	int ret;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	ret = pthread_create(thread, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		log_errno(ERROR, "Failed to start thread");
+		return false;
+	}
+	return true;
+}
+
+static void* forward_thread(void* arg) {
+	struct ForwardThread* ft = arg;
+	uint64_t one = 1;
+
+	/* Failing to tune the thread is not fatal, it just runs slower */
+	thread_configure(&ft->config);
+	ft->ok = loop_run(&ft->loop, ft->stop);
+	if (!ft->ok && write(ft->shutdown.fd, &one, sizeof(one)) < 0) {
+		log_errno(ERROR, "Failed to signal shutdown");
+	}
+	return NULL;
+}
+
+bool forward_thread_start(struct ForwardThread* ft, struct Interface* iface, struct FeatureWorker* feature_worker,
+                          int shutdown_fd, const bool* stop, const struct ThreadConfig* config) {
+	ft->iface = iface;
+	ft->config = *config;
+	ft->stop = stop;
+	ft->ok = false;
+	ft->shutdown.fd = shutdown_fd;
+	ft->shutdown.events = EPOLLIN;
+	ft->shutdown.handler = loop_stop_handler;
+	ft->shutdown.data = ft;
+
+	if (!loop_init(&ft->loop)) {
+		return false;
+	}
+	loop_busy_poll(&ft->loop, config->busy_poll_ns, config->busy_poll_budget);
+	if (!loop_add(&ft->loop, &ft->shutdown) || !forward_attach(iface, &ft->loop, feature_worker)) {
+		loop_free(&ft->loop);
+		return false;
+	}
+	if (!thread_spawn(&ft->thread, forward_thread, ft)) {
+		loop_free(&ft->loop);
+		return false;
+	}
+	return true;
+}
+
+bool forward_thread_join(struct ForwardThread* ft) {
+	pthread_join(ft->thread, NULL);
+	loop_log_stats(&ft->loop);
+	loop_free(&ft->loop);
+	return ft->ok;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "log.h"
+#include "uevent.h"
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Messages are a "ACTION@DEVPATH" header followed by KEY=VALUE strings */
+static bool uevent_parse(struct UeventMonitor* monitor, size_t size) {
+	struct Uevent event = {0};
+	const char* end = &monitor->buffer[size];
+	const char* field;
+
+	for (field = monitor->buffer; field < end; field += strlen(field) + 1) {
+		if (strncmp(field, "ACTION=", 7) == 0) {
+			event.action = &field[7];
+		} else if (strncmp(field, "DEVPATH=", 8) == 0) {
+			event.devpath = &field[8];
+		} else if (strncmp(field, "SUBSYSTEM=", 10) == 0) {
+			event.subsystem = &field[10];
+		} else if (strncmp(field, "DEVNAME=", 8) == 0) {
+			event.devname = &field[8];
+		}
+	}
+	if (!event.action || !event.devpath || !event.subsystem) {
+		return true;
+	}
+	return monitor->handler(monitor->data, &event);
+}
+
+static bool uevent_event(struct LoopSource* source, uint32_t events) {
+	struct UeventMonitor* monitor = source->data;
+	struct sockaddr_nl addr;
+	struct iovec iov = {
+		.iov_base = monitor->buffer,
+		.iov_len = sizeof(monitor->buffer) - 1,
+	};
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t size;
+
+	if (events & EPOLLERR) {
+		return false;
+	}
+	while ((size = recvmsg(source->fd, &msg, 0)) >= 0) {
+		/* Only trust the kernel, anyone can send to the multicast group */
+		if (addr.nl_pid != 0 || size == 0) {
+			continue;
+		}
+		monitor->buffer[size] = '\0';
+		if (!uevent_parse(monitor, size)) {
+			return false;
+		}
+	}
+	if (errno == ENOBUFS) {
+		/* Events were lost; nothing can be done but keep going */
+		log_fmt(WARN, "Uevent buffer overrun\n");
+		return true;
+	}
+	if (errno != EAGAIN) {
+		log_errno(ERROR, "Failed to read uevent");
+		return false;
+	}
+	return true;
+}
+
+bool uevent_init(struct UeventMonitor* monitor, struct Loop* loop, uevent_handler handler, void* data) {
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		/* Kernel events, as opposed to the ones udev sends after processing */
+		.nl_groups = 1,
+	};
+
+	monitor->handler = handler;
+	monitor->data = data;
+	monitor->source.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (monitor->source.fd < 0) {
+		log_errno(ERROR, "Failed to open uevent socket");
+		return false;
+	}
+	if (bind(monitor->source.fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		log_errno(ERROR, "Failed to bind uevent socket");
+		close(monitor->source.fd);
+		return false;
+	}
+	monitor->source.events = EPOLLIN;
+	monitor->source.handler = uevent_event;
+	monitor->source.data = monitor;
+	if (!loop_add(loop, &monitor->source)) {
+		close(monitor->source.fd);
+		return false;
+	}
+	return true;
+}
+
+void uevent_free(struct UeventMonitor* monitor, struct Loop* loop) {
+	loop_del(loop, &monitor->source);
+	close(monitor->source.fd);
+}
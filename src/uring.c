@@ -0,0 +1,405 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "forward.h"
+#include "log.h"
+#include "uring.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 64
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_map(struct Uring* ring, const struct io_uring_params* params) {
+	ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		return false;
+	}
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return false;
+		}
+	}
+	ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return false;
+	}
+
+	ring->sq_head = (unsigned*) ((uint8_t*) ring->sq_ring + params->sq_off.head);
+	ring->sq_tail = (unsigned*) ((uint8_t*) ring->sq_ring + params->sq_off.tail);
+	ring->sq_mask = (unsigned*) ((uint8_t*) ring->sq_ring + params->sq_off.ring_mask);
+	ring->sq_array = (unsigned*) ((uint8_t*) ring->sq_ring + params->sq_off.array);
+	ring->cq_head = (unsigned*) ((uint8_t*) ring->cq_ring + params->cq_off.head);
+	ring->cq_tail = (unsigned*) ((uint8_t*) ring->cq_ring + params->cq_off.tail);
+	ring->cq_mask = (unsigned*) ((uint8_t*) ring->cq_ring + params->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) ((uint8_t*) ring->cq_ring + params->cq_off.cqes);
+	ring->sq_entries = params->sq_entries;
+	return true;
+}
+
+static bool uring_submit(struct Uring* ring, unsigned wait) {
+	int ret;
+
+	while (true) {
+		ret = io_uring_enter(ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0) {
+			ring->queued -= ret < (int) ring->queued ? (unsigned) ret : ring->queued;
+			return true;
+		}
+		if (errno == EINTR) {
+			return true;
+		}
+		if (errno != EAGAIN && errno != EBUSY) {
+			log_errno(ERROR, "Failed to submit io_uring requests");
+			return false;
+		}
+	}
+}
+
+static struct io_uring_sqe* uring_sqe(struct Uring* ring) {
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe* sqe;
+
+	if (tail - head >= ring->sq_entries) {
+		if (!uring_submit(ring, 0)) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries) {
+			log_fmt(ERROR, "io_uring submission queue is full\n");
+			return NULL;
+		}
+	}
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->queued;
+	return sqe;
+}
+
+static bool uring_poll(struct Uring* ring, struct UringOp* op, int fd, uint32_t events) {
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uintptr_t) op;
+	return true;
+}
+
+static bool stream_write(struct Uring* ring, struct UringStream* stream, size_t length) {
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = stream->sink;
+	sqe->addr = (uintptr_t) stream->dir->buffer;
+	sqe->len = length;
+	sqe->buf_index = stream->buffer;
+	sqe->user_data = (uintptr_t) &stream->write;
+	return true;
+}
+
+static bool stream_read(struct Uring* ring, struct UringStream* stream) {
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = stream->source;
+	sqe->addr = (uintptr_t) stream->dir->buffer;
+	sqe->len = stream->linked ? stream->linked : sizeof(stream->dir->buffer);
+	sqe->buf_index = stream->buffer;
+	sqe->user_data = (uintptr_t) &stream->read;
+	if (stream->linked) {
+		/* The write is only issued if the read returns exactly this much */
+		sqe->flags |= IOSQE_IO_LINK;
+		return stream_write(ring, stream, stream->linked);
+	}
+	return true;
+}
+
+static bool stream_complete(struct Uring* ring, struct UringOp* op, int res) {
+	struct UringStream* stream = op->stream;
+	struct Direction* dir = stream->dir;
+
+	if (op->type == URING_READ) {
+		if (res == 0 || res == -EINTR || res == -EAGAIN) {
+			/* Nothing read: a linked write gets cancelled with the read
+			 * and retries it */
+			return stream->linked ? true : stream_read(ring, stream);
+		}
+		if (res < 0) {
+			errno = -res;
+			log_errno(ERROR, "Failed to read packet");
+			return false;
+		}
+		stream->length = res;
+		stream->read_ns = now_ns();
+		if (!report_valid(&dir->source->iface->reports, dir->type, dir->buffer, res)) {
+			counter_add(&dir->stats.invalid, 1);
+		}
+		return stream->linked ? true : stream_write(ring, stream, res);
+	}
+
+	if (res == -ECANCELED) {
+		/* The read came back short or failed, breaking the link */
+		if (stream->length == 0) {
+			return stream_read(ring, stream);
+		}
+		return stream_write(ring, stream, stream->length);
+	}
+	if (res == -EINTR || res == -EAGAIN) {
+		return stream_write(ring, stream, stream->length);
+	}
+	if (res < 0) {
+		errno = -res;
+		log_errno(ERROR, "Failed to write packet");
+		return false;
+	}
+	counter_add(&dir->stats.reports, 1);
+	counter_add(&dir->stats.bytes, res);
+	counter_set(&dir->stats.last_ns, now_ns());
+	/* There is no wakeup to measure from, so the report is timed from its
+	 * read completing */
+	hist_record(&dir->latency.total, now_ns() - stream->read_ns);
+	stream->length = 0;
+	return stream_read(ring, stream);
+}
+
+static bool uring_complete(struct Uring* ring, const struct io_uring_cqe* cqe) {
+	struct UringOp* op = (struct UringOp*) (uintptr_t) cqe->user_data;
+	bool rearm = !(cqe->flags & IORING_CQE_F_MORE);
+
+	switch (op->type) {
+	case URING_READ:
+	case URING_WRITE:
+		return stream_complete(ring, op, cqe->res);
+	case URING_FEATURE:
+		if (cqe->res < 0 || cqe->res & (EPOLLERR | EPOLLHUP)) {
+			return false;
+		}
+		feature_submit(op->iface->feature_worker, op->iface);
+		return !rearm || uring_poll(ring, op, op->iface->hidg.source.fd, EPOLLPRI);
+	case URING_LOOP:
+		if (cqe->res < 0 || !loop_dispatch(ring->loop, 0)) {
+			return false;
+		}
+		return !rearm || uring_poll(ring, op, ring->loop->epfd, EPOLLIN);
+	}
+	return false;
+}
+
+static bool set_blocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		log_errno(ERROR, "Failed to set dev flags");
+		return false;
+	}
+	return true;
+}
+
+/* Size every report in a direction shares, or 0 if they differ */
+static size_t uniform_size(const struct ReportTable* reports, enum ReportType type) {
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < reports->count; ++i) {
+		size_t this = report_size(reports, type, reports->reports[i].id);
+		if (!this) {
+			continue;
+		}
+		if (size && this != size) {
+			return 0;
+		}
+		size = this;
+	}
+	return size;
+}
+
+bool uring_init(struct Uring* ring, struct Interface* interfaces, int count, struct Loop* loop) {
+	struct io_uring_params params = {0};
+	struct iovec* buffers = NULL;
+	int* files = NULL;
+	int i;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->interfaces = interfaces;
+	ring->count = count;
+	ring->loop = loop;
+	ring->fd = io_uring_setup(URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		log_errno(WARN, "io_uring is not available");
+		return false;
+	}
+	if (!uring_map(ring, &params)) {
+		log_errno(WARN, "Failed to map io_uring");
+		goto fail;
+	}
+
+	ring->streams = calloc(count * 2, sizeof(*ring->streams));
+	ring->features = calloc(count, sizeof(*ring->features));
+	buffers = calloc(count * 2, sizeof(*buffers));
+	files = calloc(count * 2, sizeof(*files));
+	if (!ring->streams || !ring->features || !buffers || !files) {
+		log_errno(ERROR, "Failed to allocate io_uring state");
+		goto fail;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct Interface* iface = &interfaces[i];
+		struct UringStream* input = &ring->streams[i * 2];
+		struct UringStream* output = &ring->streams[i * 2 + 1];
+
+		/* The kernel blocks in its own workers instead of returning EAGAIN */
+		if (!set_blocking(iface->hidraw.source.fd) || !set_blocking(iface->hidg.source.fd)) {
+			goto fail;
+		}
+		files[i * 2] = iface->hidraw.source.fd;
+		files[i * 2 + 1] = iface->hidg.source.fd;
+
+		input->dir = &iface->input;
+		input->source = i * 2;
+		input->sink = i * 2 + 1;
+		input->buffer = i * 2;
+		input->linked = uniform_size(&iface->reports, REPORT_INPUT);
+		output->dir = &iface->output;
+		output->source = i * 2 + 1;
+		output->sink = i * 2;
+		output->buffer = i * 2 + 1;
+		output->linked = uniform_size(&iface->reports, REPORT_OUTPUT);
+		buffers[i * 2].iov_base = iface->input.buffer;
+		buffers[i * 2].iov_len = sizeof(iface->input.buffer);
+		buffers[i * 2 + 1].iov_base = iface->output.buffer;
+		buffers[i * 2 + 1].iov_len = sizeof(iface->output.buffer);
+
+		input->read = (struct UringOp) { URING_READ, input, iface };
+		input->write = (struct UringOp) { URING_WRITE, input, iface };
+		output->read = (struct UringOp) { URING_READ, output, iface };
+		output->write = (struct UringOp) { URING_WRITE, output, iface };
+		ring->features[i] = (struct UringOp) { URING_FEATURE, NULL, iface };
+	}
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_FILES, files, count * 2) < 0) {
+		log_errno(WARN, "Failed to register io_uring files");
+		goto fail;
+	}
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, buffers, count * 2) < 0) {
+		log_errno(WARN, "Failed to register io_uring buffers");
+		goto fail;
+	}
+	free(files);
+	free(buffers);
+	return true;
+
+fail:
+	free(files);
+	free(buffers);
+	uring_free(ring);
+	for (i = 0; i < count; ++i) {
+		set_nonblock(interfaces[i].hidraw.source.fd);
+		set_nonblock(interfaces[i].hidg.source.fd);
+	}
+	return false;
+}
+
+bool uring_run(struct Uring* ring, const bool* stop) {
+	unsigned head;
+	unsigned tail;
+	int i;
+
+	ring->loop_op.type = URING_LOOP;
+	if (!uring_poll(ring, &ring->loop_op, ring->loop->epfd, EPOLLIN)) {
+		return false;
+	}
+	for (i = 0; i < ring->count; ++i) {
+		struct Interface* iface = &ring->interfaces[i];
+		if (!uring_poll(ring, &ring->features[i], iface->hidg.source.fd, EPOLLPRI)) {
+			return false;
+		}
+		if (!stream_read(ring, &ring->streams[i * 2]) || !stream_read(ring, &ring->streams[i * 2 + 1])) {
+			return false;
+		}
+	}
+
+	while (!*stop) {
+		if (!uring_submit(ring, 1)) {
+			return *stop;
+		}
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			if (!uring_complete(ring, &ring->cqes[head & *ring->cq_mask])) {
+				__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+				return *stop;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+void uring_free(struct Uring* ring) {
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	free(ring->streams);
+	free(ring->features);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#define _GNU_SOURCE
+#include "endpoint.h"
+#include "forward.h"
+#include "log.h"
+#include "output.h"
+#include "report.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Output reports are checked against what the device end of a socketpair
+ * reads back. The device socket is filled up first, so the worker stalls on
+ * its first write and everything after it is queued before any of it is
+ * written. */
+
+struct Sent {
+	uint8_t id;
+	uint8_t seq;
+};
+
+static const struct Sent sent[] = {
+	{1, 1}, {1, 2}, {2, 1}, {3, 1}, {1, 3}, {3, 2}, {2, 2},
+};
+
+/* Report ID 3 keeps only its latest report, in the place of the first */
+static const struct Sent written[] = {
+	{1, 1}, {1, 2}, {2, 1}, {3, 2}, {1, 3}, {2, 2},
+};
+
+static bool check_order(int device, size_t filler) {
+	uint8_t buffer[REPORT_SIZE_MAX];
+	ssize_t size;
+	size_t i;
+
+	for (i = 0; i < filler; ++i) {
+		if (read(device, buffer, sizeof(buffer)) < 0) {
+			log_errno(ERROR, "Failed to read filler");
+			return false;
+		}
+	}
+	for (i = 0; i < sizeof(written) / sizeof(*written); ++i) {
+		size = read(device, buffer, sizeof(buffer));
+		if (size < 0) {
+			log_errno(ERROR, "Failed to read output report");
+			return false;
+		}
+		if (size != 2 || buffer[0] != written[i].id || buffer[1] != written[i].seq) {
+			log_fmt(ERROR, "Output report %zu is %u/%u, expected %u/%u\n", i, buffer[0], buffer[1],
+			        written[i].id, written[i].seq);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(void) {
+	struct ReportTable reports = {.numbered = true};
+	struct Interface iface;
+	struct OutputWorker worker;
+	struct timeval timeout = {.tv_sec = 5};
+	uint8_t report[2];
+	size_t filler = 0;
+	bool ok = false;
+	int device[2];
+	size_t i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, device) < 0) {
+		log_errno(ERROR, "Failed to create device socketpair");
+		return 1;
+	}
+	setsockopt(device[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (!set_nonblock(device[1]) || !forward_init(&iface, 0, device[1], -1, &reports)) {
+		return 1;
+	}
+	iface.hidraw.ops = &socket_ops;
+	queue_set_mode(&iface.output.queue, 3, REPORT_LATEST);
+
+	memset(report, 0, sizeof(report));
+	while (write(device[1], report, sizeof(report)) >= 0) {
+		++filler;
+	}
+	if (errno != EAGAIN) {
+		log_errno(ERROR, "Failed to fill device socket");
+		return 1;
+	}
+
+	if (!output_init(&worker)) {
+		return 1;
+	}
+	if (!output_queue_init(&iface.dispatch, &worker, &iface, &iface.output.queue)) {
+		goto free_worker;
+	}
+	for (i = 0; i < sizeof(sent) / sizeof(*sent); ++i) {
+		report[0] = sent[i].id;
+		report[1] = sent[i].seq;
+		if (output_push(&iface.dispatch, report, sizeof(report), now_ns()) < 0) {
+			log_errno(ERROR, "Failed to queue output report");
+			goto free_queue;
+		}
+	}
+	ok = check_order(device[0], filler);
+	if (ok && iface.dispatch.coalesced != 1) {
+		log_fmt(ERROR, "%" PRIu64 " output reports coalesced, expected 1\n", iface.dispatch.coalesced);
+		ok = false;
+	}
+
+free_queue:
+	output_discard(&iface.dispatch);
+free_worker:
+	output_free(&worker);
+	forward_close(&iface);
+	close(device[0]);
+	if (ok) {
+		log_fmt(INFO, "Output reports written in order\n");
+	}
+	return ok ? 0 : 1;
+}